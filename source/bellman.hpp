@@ -7,12 +7,34 @@ time-invariant, stochastic Bellman equation via fixed-point iteration.
 
 // Standard math
 #include <vector>
+#include <algorithm>
 #include <cmath>
 #include <limits>
+#include <cstdint>
+#include <cstring>
+#include <unordered_set>
 
 // Standard interfacing
 #include <iostream>
 #include <fstream>
+#include <cstdio>
+
+// Standard timing
+#include <chrono>
+
+// Standard concurrency, for writing checkpoints in the background
+#include <future>
+
+// Optional multithreading
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Optional vectorization on x86-64, used only if the running CPU supports it (define BELLMAN_SCALAR to opt out)
+#if defined(__GNUC__) and defined(__x86_64__) and not defined(BELLMAN_SCALAR)
+#define BELLMAN_AVX2 __attribute__((target("avx2,fma")))
+#include <immintrin.h>
+#endif
 
 ////////////////////////////////////////////////// ALIASES
 
@@ -26,8 +48,173 @@ using Vector = std::vector<T>; // just an abbreviation
 
 Real constexpr INF = std::numeric_limits<Real>::infinity(); // floating-point infinity
 
+// Ordering of the per-state updates within one fixed-point iteration
+enum class Sweep {
+    GAUSS_SEIDEL, // serial and in-place, so later states see this iteration's values
+    JACOBI // double-buffered, so states are independent and updated in parallel
+};
+
+// Rule for deciding that value iteration has converged, given the tolerance
+enum class Stop {
+    DELTA, // every state's value changed by less than the tolerance in the last iteration
+    CONTRACTION, // sup-norm change below tolerance*(1-discount)/(2*discount), making the policy tolerance-optimal
+    SPAN // span of the change below tolerance*(1-discount)/discount, as in relative value iteration, after
+         // which the values are shifted to the midpoint of their bounds (only valid with the Jacobi sweep)
+};
+
+// Summary of a call to improve
+struct Report {
+    uint iterations; // number of fixed-point iterations done
+    bool converged; // whether the stopping rule was met within the iterations
+    Real change; // sup-norm of the change in value over the last iteration
+    Real span; // span (maximum minus minimum) of the change in value over the last iteration
+    Real value_bound; // guaranteed sup-norm distance from the value estimate to the optimal value function
+    Real policy_bound; // guaranteed sup-norm loss of value from following the policy estimate instead of an optimal one
+    size_t skipped; // number of state-action row evaluations skipped by action elimination
+};
+
+// Solutions of several variants of one model that share its dynamic, as found by improve_many
+struct Variants {
+    uint K; // number of variants
+    Vector<Real> value; // value of state s in variant k at s*K+k
+    Vector<Index> policy; // optimal action of state s in variant k at s*K+k
+    Vector<Report> reports; // how far each variant got
+};
+
+// Method of evaluating a fixed policy within policy iteration
+enum class Evaluation {
+    SWEEPS, // in-place fixed-point sweeps of the policy's Bellman equation
+    BICGSTAB // matrix-free stabilized biconjugate-gradient solve of the policy's linear system
+};
+
 ////////////////////////////////////////////////// CORE
 
+// Compressed-sparse-row storage of the transition matrix SxAxS'. The nonzero
+// transitions for state s and action a are at positions offsets[s*nA+a] up to
+// (not including) offsets[s*nA+a+1] of the states and probabilities arrays. When there
+// are few distinct probabilities, each is instead stored as a code into a dictionary.
+// The ending states can also be delta-encoded within each row, which is sorted by them.
+struct Transitions {
+    Vector<Index> offsets; // start of each state-action row, plus one final end position
+    Vector<Index> states; // ending state of each nonzero transition, unless delta-encoded
+    Vector<Index> bases; // first ending state of each row, when delta-encoded
+    Vector<uint16_t> deltas; // difference of each ending state from the previous one in its row (0 for the first)
+    Vector<Real> probabilities; // probability of each nonzero transition, unless coded
+    Vector<float> single; // single-precision copy of the probabilities, only held during mixed-precision sweeps
+    Vector<Real> dictionary; // distinct probability values, when coded
+    Vector<float> dictionary_single; // single-precision copy of the dictionary
+    Vector<uint8_t> codes8; // dictionary position of each nonzero's probability, for up to 256 distinct values
+    Vector<uint16_t> codes16; // dictionary position of each nonzero's probability, for up to 65536 distinct values
+
+    // Most distinct probabilities that the codes can tell apart
+    static size_t constexpr MAX_DISTINCT = 65536;
+
+    // Whether the transition matrix has been stored at all
+    bool empty() const {return offsets.empty();}
+    // Number of stored nonzero transitions
+    size_t nonzeros() const {return offsets.empty() ? 0 : offsets.back();}
+    // Total bytes of storage used by the arrays
+    size_t bytes() const {
+        return offsets.size()*sizeof(Index) + states.size()*sizeof(Index) + probabilities.size()*sizeof(Real)
+             + single.size()*sizeof(float) + dictionary.size()*sizeof(Real) + dictionary_single.size()*sizeof(float)
+             + codes8.size()*sizeof(uint8_t) + codes16.size()*sizeof(uint16_t)
+             + bases.size()*sizeof(Index) + deltas.size()*sizeof(uint16_t);
+    }
+    // Whether the probabilities are stored as dictionary codes
+    bool coded() const {return not dictionary.empty();}
+    // Probability of the k-th nonzero transition, however it is stored
+    Real probability(size_t k) const {
+        return codes8.size() ? dictionary[codes8[k]] : codes16.size() ? dictionary[codes16[k]] : probabilities[k];
+    }
+    // Probabilities or dictionary in the same precision as the values they get multiplied with
+    Vector<Real> const& probabilities_for(Real) const {return probabilities;}
+    Vector<float> const& probabilities_for(float) const {return single;}
+    Vector<Real> const& dictionary_for(Real) const {return dictionary;}
+    Vector<float> const& dictionary_for(float) const {return dictionary_single;}
+
+    // Replaces the probabilities by 8-bit or 16-bit codes into a dictionary of the given distinct
+    // values they take (in any order) if there are few enough of them for the codes and dictionary
+    // to take at most half the memory of the probabilities, and returns whether it did
+    bool compress(Vector<Real> distinct);
+
+    // Whether the ending states are delta-encoded
+    bool encoded() const {return not bases.empty();}
+    // Replaces the ending states by 16-bit deltas within each row if they all fit, and returns whether it did
+    bool encode();
+    // Restores the plain ending states from their deltas
+    void decode();
+};
+
+#ifdef BELLMAN_AVX2
+// AVX2 kernels for the sparse expectation, summing over four nonzeros at a time with gathers
+namespace avx2 {
+
+// Shortest row worth vectorizing, below which the scalar loop is as fast
+Index constexpr MIN_NONZEROS = 16;
+
+// Whether the running CPU supports these kernels, checked once
+inline bool supported() {
+    static bool const avx2_fma = __builtin_cpu_supports("avx2") and __builtin_cpu_supports("fma");
+    return avx2_fma;
+}
+
+// Loads the four elements of table at the given indices (masked, to start from defined lanes)
+BELLMAN_AVX2 inline __m256d gather(Real const* table, __m128i indices) {
+    __m256d const all = _mm256_castsi256_pd(_mm256_set1_epi64x(-1));
+    return _mm256_mask_i32gather_pd(_mm256_setzero_pd(), table, indices, all, sizeof(Real));
+}
+
+// Probabilities stored directly
+struct Plain {
+    Real const* probabilities;
+    BELLMAN_AVX2 __m256d load4(Index k) const {return _mm256_loadu_pd(probabilities + k);}
+    Real load(Index k) const {return probabilities[k];}
+};
+
+// Probabilities stored as 8-bit codes into a dictionary
+struct Coded8 {
+    uint8_t const* codes;
+    Real const* dictionary;
+    BELLMAN_AVX2 __m256d load4(Index k) const {
+        int32_t packed = 0;
+        std::memcpy(&packed, codes + k, 4);
+        return gather(dictionary, _mm_cvtepu8_epi32(_mm_cvtsi32_si128(packed)));
+    }
+    Real load(Index k) const {return dictionary[codes[k]];}
+};
+
+// Probabilities stored as 16-bit codes into a dictionary
+struct Coded16 {
+    uint16_t const* codes;
+    Real const* dictionary;
+    BELLMAN_AVX2 __m256d load4(Index k) const {
+        __m128i const packed = _mm_loadl_epi64(reinterpret_cast<__m128i const*>(codes + k));
+        return gather(dictionary, _mm_cvtepu16_epi32(packed));
+    }
+    Real load(Index k) const {return dictionary[codes[k]];}
+};
+
+// Sum of probability times value of the ending state over the nonzeros from begin to end
+template <class Probabilities>
+BELLMAN_AVX2 Real dot(Index begin, Index end, Index const* states, Probabilities const& probabilities, Real const* v) {
+    __m256d sum = _mm256_setzero_pd();
+    Index k = begin;
+    for(; k+4<=end; k+=4) {
+        __m128i const indices = _mm_loadu_si128(reinterpret_cast<__m128i const*>(states + k));
+        sum = _mm256_fmadd_pd(probabilities.load4(k), gather(v, indices), sum);
+    }
+    // Reduce the lanes, then finish the remainder of the row
+    __m128d const half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+    Real total = _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+    for(; k<end; ++k) {
+        total += probabilities.load(k) * v[states[k]];
+    }
+    return total;
+}
+
+} // namespace avx2
+#endif
+
 // Abstract-base-class that various Markov decision processes can inherit from to
 // get solved by the value-iteration algorithm. Derived classes need to implement
 // the dynamic and reward methods as shown.
@@ -38,7 +225,16 @@ protected:
     Real const discount; // factor to discount future reward, between 0.0 and 1.0
     Vector<Real> value; // current optimal value function estimate
     Vector<Index> policy; // current optimal policy estimate
-    Vector<Vector<Vector<std::pair<Index, Real>>>> transitions; // optional sparse transition matrix SxAxS'
+    Transitions transitions; // optional sparse transition matrix SxAxS'
+    Vector<Real> rewards; // optional reward table SxA, indexed by s*nA+a like the transition rows
+    Vector<uint64_t> active; // optional per-state bitmask of the actions not yet eliminated as suboptimal
+    Vector<Index> permutation; // optional internal position of each state, when reordered for locality
+    Vector<Index> original; // state at each internal position, the inverse of permutation
+    Vector<uint> factors; // optional sizes of independent state factors, outermost first, multiplying to nS
+    Vector<Real> history; // sup-norm of the change in value over each iteration of improve so far
+    uint resumed; // iterations already done according to a loaded checkpoint, for the next improve to skip
+    std::string checkpoint_file; // where improve writes checkpoints, if checkpoint_interval is set
+    uint checkpoint_interval; // iterations between checkpoints, or 0 for none
 
 public:
     // Constructor
@@ -48,20 +244,113 @@ public:
     virtual Real dynamic(Index s, Index a, Index s1) const =0;
     // Returns the (deterministic) reward for selecting action a in state s
     virtual Real reward(Index s, Index a) const =0;
+    // Appends to out every ending state s1 with nonzero probability given state s and action a,
+    // paired with that probability and listed at most once. The default implementation scans
+    // dynamic over the whole state space, so derived classes that know their successors should
+    // override it to make analyze_sparsity cost O(nonzeros) instead of O(S*S*A). Like dynamic,
+    // it gets called from several threads at once
+    virtual void successors(Index s, Index a, Vector<std::pair<Index, Real>>& out) const;
+    // Appends to out every value of factor f of the ending state with nonzero probability given
+    // state s and action a, paired with that probability. Only called once the factors have been
+    // declared, for models whose factors move independently of each other given s and a
+    virtual void factor_successors(Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) const;
 
-    // Access methods
-    Real get_value_at(Index s) const {return value.at(s);}
-    Index get_action_at(Index s) const {return policy.at(s);}
-    Vector<Real> get_value() const {return value;}
-    Vector<Index> get_policy() const {return policy;}
+    // Access methods, always in terms of the model's own state numbering
+    Real get_value_at(Index s) const {return value.at(internal(s));}
+    Index get_action_at(Index s) const {return policy.at(internal(s));}
+    Vector<Real> get_value() const;
+    Vector<Index> get_policy() const;
+    Vector<Real> const& get_history() const {return history;}
 
     // Write the current solution to the given file or terminal
     virtual void record_solution(std::string const& file) const;
     virtual void print_solution() const;
+    // Write the current solution to the given file as raw binary, after a header holding nS, nA and
+    // the sizes of Index and Real, as the nS values and then the nS actions of all states with no
+    // length prefixes, and returns whether it could
+    bool record_solution_binary(std::string const& file) const;
 
     // Improves the current value function and policy estimate by the given number of
-    // fixed-point iterations or until the given convergence tolerance is met
-    void improve(uint iterations, Real tolerance);
+    // fixed-point iterations or until the given convergence tolerance is met, and reports
+    // the error bounds achieved. With eliminate set, actions proven suboptimal by those
+    // bounds are permanently dropped from later backups (requires nA <= 64). The span stopping
+    // rule requires the Jacobi sweep
+    Report improve(uint iterations, Real tolerance, Sweep sweep=Sweep::GAUSS_SEIDEL, Stop stop=Stop::DELTA,
+                   bool eliminate=false);
+
+    // Makes improve write the value, policy, iteration count and change history to the given file
+    // every given number of iterations and when it finishes, from a copy on a background thread so
+    // the sweeps carry on meanwhile (an interval of 0 turns checkpoints off)
+    void checkpoint(std::string const& file, uint interval);
+    // Restores the value, policy and change history from a checkpoint of this model, so that the next
+    // improve call carries on after the iteration it was written at, and returns whether it did
+    bool load_state(std::string const& file);
+
+    // Same as improve with the Gauss-Seidel sweep (so not the span stopping rule), but first iterating
+    // on single-precision values and probabilities, which halves their memory traffic, until the changes
+    // approach single-precision rounding error, and only then refining the values in double precision
+    // to meet the tolerance
+    Report improve_mixed(uint iterations, Real tolerance, Stop stop=Stop::DELTA);
+
+    // Improves the current value function and policy estimate asynchronously, always backing up
+    // the state with the largest bound on its Bellman residual and raising the bounds of its
+    // predecessors, until every residual is within tolerance or after the given number of
+    // sweeps' worth of state updates (requires the transitions attribute)
+    Report improve_prioritized(uint sweeps, Real tolerance);
+
+    // Improves the current value function and policy estimate by decomposing the transition graph
+    // into strongly connected components and solving them one at a time in reverse topological
+    // order, each by in-place sweeps over its own states for at most the given number of
+    // iterations or until the given convergence tolerance is met (requires the transitions attribute)
+    Report improve_topological(uint iterations, Real tolerance);
+
+    // Solves K variants of the model at once, which differ from it only in their discount factors
+    // and/or reward tables (indexed by s*nA+a), either list broadcasting if it has one entry and
+    // defaulting to the model's own if empty. Every in-place sweep passes over each transition row
+    // once to update the values of all variants still short of the tolerance, for at most the given
+    // number of iterations, leaving the model's own value and policy untouched (requires the
+    // transitions attribute)
+    Variants improve_many(uint iterations, Real tolerance, Vector<Real> const& discounts,
+                          Vector<Vector<Real>> const& rewards={});
+
+    // Improves the current value function and policy estimate by in-place sweeps like improve, but
+    // reading the transitions from a file written by save_model or save_model_streamed with the given
+    // key instead of the transitions attribute. Only the values, rewards and per-row arrays stay in
+    // memory, while the ending states and probabilities are streamed in blocks of consecutive states
+    // of about the given size, the next block being read on a second thread while the current one is
+    // backed up. If the file numbers the states differently, the model switches to its numbering,
+    // which requires that the model holds no transitions of its own
+    Report improve_streamed(std::string const& file, uint64_t key, uint iterations, Real tolerance,
+                            size_t block_bytes=size_t(64) << 20);
+
+    // Improves the current value function and policy estimate by the given number of policy
+    // iterations, each a greedy improvement sweep followed by the given number of evaluation
+    // sweeps or solver iterations on the improved policy (modified policy iteration), or by
+    // evaluating until the tolerance is met if evaluations is 0 (policy iteration)
+    void improve_policy(uint iterations, Real tolerance, uint evaluations=0,
+                        Evaluation evaluation=Evaluation::SWEEPS);
+
+    // Evaluates the current policy by in-place fixed-point sweeps, stopping after the given
+    // number of sweeps or once the tolerance is met if sweeps is 0, and returns the sweeps done
+    uint evaluate_policy(uint sweeps, Real tolerance);
+    // Evaluates the current policy by solving (I - discount*P) v = r with BiCGSTAB, warm-started
+    // from the current value estimate. Stops after the given number of iterations or once the
+    // sup-norm of the residual is within tolerance if iterations is 0, and returns the number of
+    // operator applications done, each of which costs about one evaluation sweep
+    uint evaluate_policy_bicgstab(uint iterations, Real tolerance);
+
+    // Returns the best value over actions for state s against the value function estimate v,
+    // and stores the maximizing action in best_action
+    virtual Real backup(Index s, Vector<Real> const& v, Index& best_action) const;
+    virtual float backup(Index s, Vector<float> const& v, Index& best_action) const;
+    // Backs up every state against the value function estimate v at once, in parallel, storing the
+    // best values in next and the maximizing actions in the policy attribute
+    virtual void backup_all(Vector<Real> const& v, Vector<Real>& next);
+    // Returns the value of selecting action a in state s against the value function estimate v
+    virtual Real evaluate(Index s, Index a, Vector<Real> const& v) const;
+    // Same as backup, but starting from the incumbent action passed in best_action, and also
+    // eliminating every action whose value falls more than margin below the best one
+    virtual Real eliminate(Index s, Vector<Real> const& v, Index& best_action, Real margin);
 
     // Helper for converting multidimensional coordinates to a linear vector index
     Index index_from_coords(Vector<uint> const& coords, Vector<uint> const& dims) const;
@@ -71,34 +360,523 @@ public:
     // Helper function to verify that the implemented 'dynamic' or 'transitions' is a probability distribution
     void verify_dynamic() const;
 
-    // Iterates over all transitions and stores those with nonzero probability in the transitions attribute
+    // Enumerates the successors of every state-action pair, in parallel over starting states,
+    // and stores them in the transitions attribute
     void analyze_sparsity();
+
+    // Declares the state as a tuple of independent factors of the given sizes, numbered like
+    // index_from_coords, whose transitions are the product of the kernels from factor_successors.
+    // Without the transitions attribute, expectations are then computed by contracting the value
+    // tensor one factor at a time instead of storing or scanning whole rows
+    void factorize(Vector<uint> const& sizes);
+
+    // Delta-encodes the ending states of each transition row in 16 bits where they fit, to
+    // reduce memory traffic during sweeps (requires the transitions attribute)
+    void compress_states();
+
+    // Evaluates reward for every state-action pair once and stores it in the rewards attribute
+    void analyze_rewards();
+
+    // Returns a key identifying the model by its shape, discount, the given parameters and samples of
+    // its reward and successors at up to 64 states, for tagging saved models. The samples catch most
+    // but not all edits to the rules, so derived classes should also include a revision of their own
+    uint64_t fingerprint(Vector<Real> const& parameters) const;
+    // Writes the transitions and rewards attributes, and any reordering, to a binary file tagged
+    // with the given key, and returns whether it could (failing leaves any earlier file intact)
+    bool save_model(std::string const& file, uint64_t key) const;
+    // Reads back what save_model wrote, one bulk read per array, if the file exists, matches the
+    // key, format and shape of this model and holds consistent arrays, and returns whether it did
+    bool load_model(std::string const& file, uint64_t key);
+    // Writes the same file as save_model, but with the rows enumerated by successors straight into it
+    // instead of stored in the transitions attribute, for models whose transitions do not fit in memory.
+    // It takes two passes over the successors, one to size the rows and one to write them, holding only
+    // the row offsets and rewards in memory, and keeps the probabilities uncoded and the model's own
+    // numbering. Returns whether it could write the file, which can hold at most 2^32-1 nonzeros
+    bool save_model_streamed(std::string const& file, uint64_t key) const;
+
+    // Renumbers the states internally in reverse Cuthill-McKee order of the transition graph, so
+    // that each state's successors sit close to it in memory during sweeps. Reordering is invisible
+    // through the access and output methods, but backup, evaluate and eliminate take the internal
+    // state numbering (requires the transitions attribute)
+    void reorder_states();
+
+protected:
+    // Implementations of backup and evaluate that query the model through the given reward(s,a)
+    // and dynamic(s,a,s1) callables, so that derived templates can supply statically-bound ones,
+    // computing in the precision V of the given values
+    template <class V, class RewardFn, class DynamicFn, class FactorFn>
+    V backup_with(Index s, Vector<V> const& v, Index& best_action,
+                  RewardFn const& reward_fn, DynamicFn const& dynamic_fn, FactorFn const& factor_fn) const;
+    template <class V, class RewardFn, class DynamicFn, class FactorFn>
+    V evaluate_with(Index s, Index a, Vector<V> const& v,
+                    RewardFn const& reward_fn, DynamicFn const& dynamic_fn, FactorFn const& factor_fn) const;
+    // Expected value under v of the ending state of the given row of the transitions t, from whichever
+    // storage the probabilities are in, and vectorized in double precision where supported
+    template <class V>
+    static V sparse_expectation(Transitions const& t, Index row, Vector<V> const& v);
+    static Real sparse_expectation(Transitions const& t, Index row, Vector<Real> const& v);
+    // Expected value under v of the ending state of the given row of the transitions t, with the
+    // probability of its k-th nonzero given by probability_fn(k)
+    template <class V, class ProbabilityFn>
+    static V expectation_with(Transitions const& t, Index row, Vector<V> const& v, ProbabilityFn const& probability_fn);
+    // Calls fn(s1, p) for the ending state and probability of every nonzero of the given transition row
+    template <class Fn>
+    void for_each_transition(Index row, Fn const& fn) const;
+    template <class ProbabilityFn, class Fn>
+    void for_each_transition_with(Index row, ProbabilityFn const& probability_fn, Fn const& fn) const;
+    // Stores in sums the expectations over the given transition row of W columns of values, where
+    // v points at the first of them for state 0 and stride separates the rows of the value matrix
+    template <Index W>
+    void sum_columns(Index row, Real const* v, uint stride, Real* sums) const;
+    // Expected value under v of the ending state, given the kernel of each factor from f on and
+    // the index of the ending state so far from the outer factors
+    template <class V>
+    V contract(Vector<Vector<std::pair<Index, Real>>> const& kernels, uint f, Index base, Vector<V> const& v) const;
+    template <class RewardFn, class DynamicFn, class FactorFn>
+    Real eliminate_with(Index s, Vector<Real> const& v, Index& best_action, Real margin,
+                        RewardFn const& reward_fn, DynamicFn const& dynamic_fn, FactorFn const& factor_fn);
+    // Implementation of successors that multiplies out the kernels of the factors, as given by
+    // the factor_successors(s,a,f,out) callable
+    template <class FactorFn>
+    void expand_with(Index s, Index a, Vector<std::pair<Index, Real>>& out, FactorFn const& factor_fn) const;
+
+    // Whether action a has not been eliminated for state s
+    bool is_active(Index s, Index a) const {return active.empty() or ((active[s] >> a) & 1);}
+
+    // Writes the given header and then one line of text per state, as appended to a string by
+    // line(s, out), formatting chunks of consecutive states in parallel and writing each in one call
+    template <class LineFn>
+    void record_lines(std::string const& file, std::string const& header, LineFn const& line) const;
+    // Appends each of the given fields to out, with numbers formatted as by a default std::ostream
+    static void append(std::string& /*out*/) {}
+    template <class Field, class... Fields>
+    static void append(std::string& out, Field field, Fields... fields) {
+        append_field(out, field);
+        append(out, fields...);
+    }
+    static void append_field(std::string& out, char const* text) {out += text;}
+    static void append_field(std::string& out, long long x);
+    static void append_field(std::string& out, int x) {append_field(out, (long long)x);}
+    static void append_field(std::string& out, uint x) {append_field(out, (long long)x);}
+    static void append_field(std::string& out, Real x);
+
+    // Binary file layouts of save_model and record_solution_binary, to be bumped whenever they change
+    static constexpr uint32_t MODEL_VERSION = 1;
+    static constexpr uint32_t SOLUTION_VERSION = 2;
+    // Helpers for writing and reading an array to and from a saved model as its size followed by its
+    // raw contents, where reading checks the size against the bytes the file has left
+    template <class T>
+    static void write_array(std::ofstream& stream, Vector<T> const& array);
+    template <class T>
+    static bool read_array(std::ifstream& stream, size_t file_size, Vector<T>& array);
+    // Position in a saved model of the contents of an array, and its size
+    struct Section {
+        std::streamoff position;
+        uint64_t size;
+    };
+    // Helpers for noting where an array of a saved model is and moving past it, and for reading
+    // count of its elements from the given one on
+    template <class T>
+    static bool skip_array(std::ifstream& stream, size_t file_size, Section& section);
+    template <class T>
+    static bool read_slice(std::ifstream& stream, Section const& section, size_t first, size_t count, Vector<T>& out);
+    // Writes the header of a saved model, and opens one and reads its header, returning whether it
+    // matches the key and this model
+    void write_header(std::ofstream& stream, uint64_t key) const;
+    bool open_model(std::ifstream& stream, std::string const& file, uint64_t key, size_t& file_size) const;
+    // Splits the states into runs of consecutive ones whose rows, as given by offsets, hold at most the
+    // given number of nonzeros, or a single state if it alone holds more, returning where each run starts
+    // followed by nS
+    Vector<Index> split_states(Vector<Index> const& offsets, size_t nonzeros) const;
+    // Whether the arrays of a saved model, given in full for the per-row ones and by size for the
+    // others, fit together as transitions, rewards and a numbering of the states of this model
+    bool fits_model(Vector<Index> const& offsets, Vector<Index> const& bases, size_t states, size_t deltas,
+                    size_t probabilities, size_t dictionary, size_t codes8, size_t codes16, size_t rewards,
+                    Vector<Index> const& permutation, Vector<Index> const& original) const;
+    // Whether every ending state and dictionary code of the given transitions is in range
+    bool fits_states(Transitions const& t) const;
+    // Switches to the given internal numbering of the states (empty for the model's own), carrying the
+    // values, policy, eliminated actions and rewards over to it, but not the transitions
+    void renumber(Vector<Index> const& to_permutation, Vector<Index> const& to_original);
+
+    // Binary file layout of checkpoints, to be bumped whenever it changes
+    static constexpr uint32_t STATE_VERSION = 1;
+    // Writes a checkpoint of the given values, policy and change history after the given iteration,
+    // through a temporary file so that a failed or interrupted write leaves the previous checkpoint
+    // intact, and returns whether it could
+    bool write_state(std::string const& file, Vector<Real> const& v, Vector<Index> const& pi,
+                     Vector<Real> const& changes, uint iteration) const;
+
+    // Conversions between the model's state numbering and the internal one used for storage
+    Index internal(Index s) const {return permutation.empty() ? s : permutation[s];}
+    Index external(Index s) const {return original.empty() ? s : original[s];}
+};
+
+// Intermediate base-class that binds the solver's inner loops to the Derived class's own
+// dynamic and reward methods at compile time, so they can be inlined instead of dispatched
+// virtually for every transition. Use it as "class Model : public BellmanT<Model>".
+template <class Derived>
+class BellmanT : public Bellman {
+public:
+    using Bellman::Bellman;
+
+    Real backup(Index s, Vector<Real> const& v, Index& best_action) const override;
+    float backup(Index s, Vector<float> const& v, Index& best_action) const override;
+    Real evaluate(Index s, Index a, Vector<Real> const& v) const override;
+    Real eliminate(Index s, Vector<Real> const& v, Index& best_action, Real margin) override;
+    void successors(Index s, Index a, Vector<std::pair<Index, Real>>& out) const override;
+};
+
+// Base-class for small, fully-dense Markov decision processes given by their transition and
+// reward matrices, which it stores contiguously so that a Jacobi sweep computes every action
+// value at once as one blocked matrix-vector product. Use it as "class Model : public DenseBellman".
+class DenseBellman : public BellmanT<DenseBellman> {
+protected:
+    Vector<Real> P; // transition matrix (AxS)xS', with row a*nS+s holding the distribution over s1
+    Vector<Real> R; // reward matrix AxS, indexed by a*nS+s
+    Vector<Real> Q; // scratch for the expected next value of every action, indexed like R
+
+public:
+    // Constructor from the transition matrices T[a][s][s1] and rewards R[a][s]
+    DenseBellman(Vector<Vector<Vector<Real>>> const& T, Vector<Vector<Real>> const& R, Real discount);
+
+    Real dynamic(Index s, Index a, Index s1) const final {return P[(size_t(a)*nS + s)*nS + s1];}
+    Real reward(Index s, Index a) const final {return R[a*nS + s];}
+
+    // Scans the contiguous rows of state s, unless sparse transitions or reordering are in use
+    Real backup(Index s, Vector<Real> const& v, Index& best_action) const override;
+    // Computes every action value as R + discount*P*v, blocked over ending states, then maximizes
+    void backup_all(Vector<Real> const& v, Vector<Real>& next) override;
+};
+
+// Many independent dense Markov decision processes of the same shape, solved together. Instances
+// are stored innermost in blocks of LANES, so that one sweep updates a whole block with vector
+// instructions. Each thread sweeps its own block of lanes, and as soon as the instance in a lane
+// converges, it swaps in the next unsolved instance so that finished ones cost no more work.
+class DenseBatch {
+public:
+    static constexpr Index LANES = 8; // instances per block
+
+protected:
+    uint const N; // number of instances
+    uint const nS; // cardinality of the state space of every instance
+    uint const nA; // cardinality of the action space of every instance
+    uint const nB; // number of blocks of instances
+    Vector<Real> P; // transition matrices, indexed by (((b*nA + a)*nS + s)*nS + s1)*LANES + l for instance b*LANES+l
+    Vector<Real> R; // reward matrices, indexed by ((b*nA + a)*nS + s)*LANES + l
+    Vector<Real> discount; // discount factor of each instance
+    Vector<Real> value; // current optimal value function estimates, indexed by (b*nS + s)*LANES + l
+    Vector<Index> policy; // current optimal policy estimates, indexed like value
+    Vector<uint> sweeps; // sweeps done by each instance in the last call to improve
+
+public:
+    // Constructor for N instances, each with transitions that stay put and no reward until set
+    DenseBatch(uint N, uint nS, uint nA);
+
+    // Sets instance n from its transition matrices T[a][s][s1], rewards R[a][s] and discount factor
+    void set_model(Index n, Vector<Vector<Vector<Real>>> const& T, Vector<Vector<Real>> const& R, Real discount);
+
+    // Value-iterates every instance by in-place sweeps for at most the given number of iterations
+    // or until its values change by less than the tolerance, and returns how many converged
+    uint improve(uint iterations, Real tolerance);
+
+    // Access methods
+    Real get_value_at(Index n, Index s) const {return value.at(lane(n, nS, s));}
+    Index get_action_at(Index n, Index s) const {return policy.at(lane(n, nS, s));}
+    uint get_sweeps_at(Index n) const {return sweeps.at(n);}
+
+protected:
+    // Position of entry k of instance n in an array holding size entries per instance
+    static size_t lane(Index n, size_t size, size_t k) {return ((n/LANES)*size + k)*LANES + n%LANES;}
 };
 
 ////////////////////////////////////////////////// IMPLEMENTATIONS
 
+bool Transitions::compress(Vector<Real> distinct) {
+    // Put the dictionary in increasing order to look up positions in it
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    if(distinct.empty() or (distinct.size() > MAX_DISTINCT)) return false;
+    // Only worth an indirect load per nonzero if it clearly saves memory, counting both dictionaries
+    size_t const code_bytes = (distinct.size() <= 256) ? sizeof(uint8_t) : sizeof(uint16_t);
+    size_t const coded_bytes = probabilities.size()*code_bytes + distinct.size()*(sizeof(Real) + sizeof(float));
+    if(2*coded_bytes > probabilities.size()*sizeof(Real)) return false;
+    // Look up each probability's position in the dictionary
+    auto const code = [&distinct](Real p) {
+        return std::lower_bound(distinct.begin(), distinct.end(), p) - distinct.begin();
+    };
+    if(distinct.size() <= 256) {
+        codes8.resize(probabilities.size());
+        #pragma omp parallel for schedule(static)
+        for(size_t k=0; k<probabilities.size(); ++k) {
+            codes8[k] = code(probabilities[k]);
+        }
+    } else {
+        codes16.resize(probabilities.size());
+        #pragma omp parallel for schedule(static)
+        for(size_t k=0; k<probabilities.size(); ++k) {
+            codes16[k] = code(probabilities[k]);
+        }
+    }
+    dictionary.swap(distinct);
+    dictionary_single.assign(dictionary.begin(), dictionary.end());
+    // The codes now stand in for the full probabilities
+    Vector<Real>().swap(probabilities);
+    Vector<float>().swap(single);
+    return true;
+}
+
+/////////////////////////
+
+bool Transitions::encode() {
+    if(encoded()) return true;
+    if(empty()) return false;
+    Index const rows = offsets.size() - 1;
+    // Check that every gap fits before committing to the encoding
+    for(Index row=0; row<rows; ++row) {
+        for(Index k=offsets[row]+1; k<offsets[row+1]; ++k) {
+            if(states[k] - states[k-1] > std::numeric_limits<uint16_t>::max()) return false;
+        }
+    }
+    bases.assign(rows, 0);
+    deltas.resize(states.size());
+    for(Index row=0; row<rows; ++row) {
+        if(offsets[row] == offsets[row+1]) continue;
+        bases[row] = states[offsets[row]];
+        deltas[offsets[row]] = 0;
+        for(Index k=offsets[row]+1; k<offsets[row+1]; ++k) {
+            deltas[k] = states[k] - states[k-1];
+        }
+    }
+    Vector<Index>().swap(states);
+    return true;
+}
+
+/////////////////////////
+
+void Transitions::decode() {
+    if(not encoded()) return;
+    Index const rows = offsets.size() - 1;
+    states.resize(deltas.size());
+    for(Index row=0; row<rows; ++row) {
+        Index s1 = bases[row];
+        for(Index k=offsets[row]; k<offsets[row+1]; ++k) {
+            s1 += deltas[k];
+            states[k] = s1;
+        }
+    }
+    Vector<Index>().swap(bases);
+    Vector<uint16_t>().swap(deltas);
+}
+
+/////////////////////////
+
+
 Bellman::Bellman(uint nS, uint nA, Real discount) :
     nS(nS),
     nA(nA),
     discount(discount),
     value(nS),
-    policy(nS) {
+    policy(nS),
+    resumed(0),
+    checkpoint_interval(0) {
 }
 
 /////////////////////////
 
-void Bellman::record_solution(std::string const& file) const {
-    // Open and clear file
-    std::ofstream stream;
-    stream.open(file);
-    // Write header string as first line
-    stream << "s, a, v" << std::endl;
+void Bellman::successors(Index s, Index a, Vector<std::pair<Index, Real>>& out) const {
+    // Multiply out the factors' kernels if declared
+    if(not factors.empty()) {
+        expand_with(s, a, out, [this](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+            factor_successors(s, a, f, out);
+        });
+        return;
+    }
+    // Iterate over all possible ending states
+    for(Index s1=0; s1<nS; ++s1) {
+        Real p = dynamic(s, a, s1);
+        if(p > 0.0) {
+            out.emplace_back(s1, p);
+        }
+    }
+}
+
+/////////////////////////
+
+void Bellman::factor_successors(Index s, Index a, Index f, Vector<std::pair<Index, Real>>& /*out*/) const {
+    std::cerr << "================" << std::endl;
+    std::cerr << "Factored model needs factor_successors implemented (asked for factor " << f
+              << " of state " << s << " and action " << a << ")." << std::endl;
+    std::cerr << "================" << std::endl;
+    throw -1;
+}
+
+/////////////////////////
+
+template <class FactorFn>
+void Bellman::expand_with(Index s, Index a, Vector<std::pair<Index, Real>>& out, FactorFn const& factor_fn) const {
+    // Start from the empty prefix of the ending state and extend it by one factor at a time
+    Vector<std::pair<Index, Real>> prefixes = {{0, 1.0}};
+    Vector<std::pair<Index, Real>> kernel, extended;
+    for(uint f=0; f<factors.size(); ++f) {
+        kernel.clear();
+        factor_fn(s, a, f, kernel);
+        extended.clear();
+        for(std::pair<Index, Real> const& s1_p : prefixes) {
+            for(std::pair<Index, Real> const& x_p : kernel) {
+                extended.emplace_back(s1_p.first*factors[f] + x_p.first, s1_p.second*x_p.second);
+            }
+        }
+        prefixes.swap(extended);
+    }
+    out.insert(out.end(), prefixes.begin(), prefixes.end());
+}
+
+/////////////////////////
+
+Vector<Real> Bellman::get_value() const {
+    Vector<Real> external_value(nS);
+    for(Index s=0; s<nS; ++s) {
+        external_value[s] = value[internal(s)];
+    }
+    return external_value;
+}
+
+/////////////////////////
+
+Vector<Index> Bellman::get_policy() const {
+    Vector<Index> external_policy(nS);
     for(Index s=0; s<nS; ++s) {
-        // Write comma-delimited state-action-value tuples
-        stream << s << ", " << policy[s] << ", " << value[s] << std::endl;
+        external_policy[s] = policy[internal(s)];
     }
-    // Close file
+    return external_policy;
+}
+
+/////////////////////////
+
+void Bellman::record_solution(std::string const& file) const {
+    // Write header string as first line, and then comma-delimited state-action-value tuples
+    record_lines(file, "s, a, v\n", [this](Index s, std::string& out) {
+        append(out, s, ", ", policy[internal(s)], ", ", value[internal(s)], "\n");
+    });
+}
+
+/////////////////////////
+
+bool Bellman::record_solution_binary(std::string const& file) const {
+    std::ofstream stream(file, std::ios::binary | std::ios::trunc);
+    uint32_t const header[] = {SOLUTION_VERSION, nS, nA, sizeof(Index), sizeof(Real)};
+    stream.write("BELLSOL", 8);
+    stream.write(reinterpret_cast<char const*>(header), sizeof(header));
+    // The header already gives the length of both arrays
+    Vector<Real> const v = get_value();
+    Vector<Index> const pi = get_policy();
+    stream.write(reinterpret_cast<char const*>(v.data()), v.size()*sizeof(Real));
+    stream.write(reinterpret_cast<char const*>(pi.data()), pi.size()*sizeof(Index));
     stream.close();
+    if(not stream) {
+        std::cout << "(Bellman: could not record solution to " << file << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/////////////////////////
+
+template <class LineFn>
+void Bellman::record_lines(std::string const& file, std::string const& header, LineFn const& line) const {
+    // Format up to ROUND chunks of CHUNK states at a time, so that the text in memory stays bounded
+    Index constexpr CHUNK = 16384;
+    Index constexpr ROUND = 64;
+    Index const chunks = (nS + CHUNK - 1)/CHUNK;
+    Vector<std::string> texts(std::min(chunks, ROUND));
+    std::ofstream stream(file, std::ios::binary | std::ios::trunc);
+    stream.write(header.data(), header.size());
+    for(Index first=0; first<chunks; first+=ROUND) {
+        Index const last = std::min(first + ROUND, chunks);
+        #pragma omp parallel for schedule(dynamic)
+        for(Index c=first; c<last; ++c) {
+            std::string& text = texts[c - first];
+            text.clear();
+            for(Index s=c*CHUNK; s<std::min((c+1)*CHUNK, nS); ++s) {
+                line(s, text);
+            }
+        }
+        for(Index c=first; c<last; ++c) {
+            stream.write(texts[c - first].data(), texts[c - first].size());
+        }
+    }
+}
+
+/////////////////////////
+
+void Bellman::append_field(std::string& out, long long x) {
+    // Write the digits backwards into a buffer large enough for any 64-bit integer
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* begin = end;
+    unsigned long long magnitude = (x < 0) ? -(unsigned long long)x : x;
+    do {
+        *--begin = '0' + magnitude%10;
+        magnitude /= 10;
+    } while(magnitude);
+    if(x < 0) *--begin = '-';
+    out.append(begin, end);
+}
+
+/////////////////////////
+
+void Bellman::append_field(std::string& out, Real x) {
+    // A default std::ostream writes six significant digits, in fixed notation for decimal exponents
+    // from -4 to 5. Those get rounded here from the value scaled by an exact power of ten, which is
+    // within 1e-9 of the exact decimal scaling, leaving to snprintf only the near-ties where that
+    // could round differently, and the other exponents, zeros, infinities and NaNs
+    static Real const powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10};
+    static uint const places[] = {100000, 10000, 1000, 100, 10, 1};
+    uint64_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    bool const special = (x == 0.0) or (((bits >> 52) & 0x7ff) == 0x7ff);
+    Real const magnitude = fabs(x);
+    int exponent = (special or (magnitude < 1e-4)) ? -5 : -4;
+    while((exponent <= 5) and (magnitude >= powers[exponent + 5]*1e-4)) exponent++;
+    for(uint attempt=0; (attempt < 3) and (exponent >= -4) and (exponent <= 5); ++attempt) {
+        int const shift = 5 - exponent;
+        Real const scaled = (shift >= 0) ? magnitude*powers[shift] : magnitude/powers[-shift];
+        uint64_t const whole = scaled;
+        if(fabs(scaled - whole - 0.5) < 1e-9) break;
+        // Correct an exponent that the search or the rounding put off by one
+        uint const rounded = whole + (scaled - whole >= 0.5);
+        if(rounded >= 1000000) {
+            exponent++;
+            continue;
+        }
+        if(rounded < 100000) {
+            exponent--;
+            continue;
+        }
+        // Write the digits around the decimal point, dropping trailing zeros after it
+        char text[16];
+        char* end = text;
+        if(x < 0.0) *end++ = '-';
+        if(exponent < 0) {
+            *end++ = '0';
+            *end++ = '.';
+            for(int i=-1; i>exponent; --i) *end++ = '0';
+        }
+        for(int i=0; i<6; ++i) {
+            *end++ = '0' + (rounded/places[i])%10;
+            if((i == exponent) and (i < 5)) *end++ = '.';
+        }
+        if(exponent < 5) {
+            while(*(end-1) == '0') --end;
+            if(*(end-1) == '.') --end;
+        }
+        out.append(text, end);
+        return;
+    }
+    char text[32];
+    int const length = snprintf(text, sizeof(text), "%g", x);
+    out.append(text, length);
 }
 
 /////////////////////////
@@ -111,146 +889,2379 @@ void Bellman::print_solution() const {
     std::cout << "----------------" << std::endl;
     for(Index s=0; s<nS; ++s) {
         // Print pipe-delimited state-action-value tuples
-        std::cout << s << " | " << policy[s] << " | " << value[s] << std::endl;
+        std::cout << s << " | " << policy[internal(s)] << " | " << value[internal(s)] << std::endl;
     }
     std::cout << "=================" << std::endl;
 }
 
 /////////////////////////
 
-void Bellman::improve(uint iterations, Real tolerance) {
-    bool converged;
+Report Bellman::improve(uint iterations, Real tolerance, Sweep sweep, Stop stop, bool eliminate) {
+    Report report = {0, false, INF, INF, INF, INF, 0};
+    // Action elimination needs every action enabled at first, and keeps whatever earlier calls eliminated
+    if(eliminate and (nA > 64)) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Action elimination supports at most 64 actions, got " << nA << "." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    if(eliminate and active.empty()) {
+        active.assign(nS, (nA == 64) ? ~uint64_t(0) : ((uint64_t(1) << nA) - 1));
+    }
+    // The span bounds hold only if every state is backed up against the previous iteration's values
+    if((stop == Stop::SPAN) and (sweep != Sweep::JACOBI)) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "The span stopping rule needs the Jacobi sweep." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    // Actions whose value trails the best by more than this cannot be optimal, given the error bound
+    Real margin = INF;
+    // Second buffer for the Jacobi sweep to write into while the first is being read
+    Vector<Real> next;
+    if(sweep == Sweep::JACOBI) {
+        next.resize(nS);
+    }
+    // Carry on after the iterations of a loaded checkpoint, if any, or otherwise start a new history
+    uint const first = resumed + 1;
+    resumed = 0;
+    if(first == 1) history.clear();
+    report.iterations = first - 1;
+    // Checkpoint being written in the background, waited on before the next one starts
+    std::future<bool> writing;
+    uint writing_iteration = 0;
+    // Reports a checkpoint that could not be written, which leaves the previous one in place
+    auto const check_written = [this](bool written, uint iteration) {
+        if(not written) {
+            std::cout << "(Bellman: could not write checkpoint " << checkpoint_file << " after iteration "
+                      << iteration << ", carrying on)" << std::endl;
+        }
+    };
     std::cout << "=================================" << std::endl;
     std::cout << "Bellman: improvement beginning..." << std::endl;
-    for(uint i=1; i<=iterations; ++i) {
+#ifdef _OPENMP
+    if(sweep == Sweep::JACOBI) {
+        std::cout << "(Jacobi sweep on " << omp_get_max_threads() << " threads)" << std::endl;
+    }
+#endif
+    if(first > 1) {
+        std::cout << "(resuming after iteration " << first - 1 << ")" << std::endl;
+    }
+    // Time the iterations to report the cost of a single sweep
+    auto const start = std::chrono::steady_clock::now();
+    for(uint i=first; i<=iterations; ++i) {
+        report.iterations = i;
         // Alert user of progress
         if(fmod(100.0*i/iterations, 20.0) == 0.0) {
             std::cout << "(" << i << " / " << iterations << ")" << std::endl;
         }
-        // Assume converged unless any values prove to still be changing
-        converged = true;
-        // Iterate over starting states
-        for(Index s=0; s<nS; ++s) {
-            // Prepare to maximize over actions
-            Real best_value = -INF;
-            Index best_action = 0;
-            // Iterate over action choices
-            for(Index a=0; a<nA; ++a) {
-                // Prepare to compute expected next value
-                Real expectation = 0.0;
-                // Iterate over ending states to accrue expectation integral
-                if(transitions.size()) {
-                    // Leverage sparsity to sum only possible transitions
-                    for(std::pair<Index, Real> const& s1_p : transitions[s][a]) {
-                        expectation += s1_p.second * value[s1_p.first];
-                    }
-                } else {
-                    // Sum over all ending states
-                    for(Index s1=0; s1<nS; ++s1) {
-                        expectation += dynamic(s, a, s1) * value[s1];
-                    }
-                }
-                // Compare candidate to best so far
-                Real candidate = reward(s, a) + discount*expectation;
-                if(candidate > best_value) {
-                    best_value = candidate;
-                    best_action = a;
+        // Count the rows that this iteration will skip
+        if(not active.empty()) {
+            for(Index s=0; s<nS; ++s) {
+                report.skipped += nA - __builtin_popcountll(active[s]);
+            }
+        }
+        // Track the extremes of the change in value over this iteration
+        Real max_change = -INF;
+        Real min_change = INF;
+        if(sweep == Sweep::JACOBI) {
+            // Back up all starting states, reading only the previous iteration's values
+            if(eliminate) {
+                #pragma omp parallel for schedule(static)
+                for(Index s=0; s<nS; ++s) {
+                    next[s] = this->eliminate(s, value, policy[s], margin);
                 }
+            } else {
+                backup_all(value, next);
+            }
+            #pragma omp parallel for schedule(static) reduction(max:max_change) reduction(min:min_change)
+            for(Index s=0; s<nS; ++s) {
+                max_change = std::max(max_change, next[s] - value[s]);
+                min_change = std::min(min_change, next[s] - value[s]);
+            }
+            // Fixed-point iterate on value for all starting states at once
+            value.swap(next);
+        } else {
+            // Iterate over starting states
+            for(Index s=0; s<nS; ++s) {
+                Index best_action = policy[s];
+                Real const best_value = eliminate ? this->eliminate(s, value, best_action, margin) : backup(s, value, best_action);
+                max_change = std::max(max_change, best_value - value[s]);
+                min_change = std::min(min_change, best_value - value[s]);
+                // Fixed-point iterate on value for this starting state
+                value[s] = best_value;
+                policy[s] = best_action;
             }
-            // Check convergence of this state's value
-            converged = converged and (fabs(value[s] - best_value) < tolerance);
-            // Fixed-point iterate on value for this starting state
-            value[s] = best_value;
-            policy[s] = best_action;
+        }
+        // Bound the distance to the optimal value function by the contraction property
+        report.change = std::max(max_change, -min_change);
+        report.span = max_change - min_change;
+        Real const factor = discount/(1.0 - discount);
+        if(stop == Stop::SPAN) {
+            // Shifted to the middle of the bounds v + factor*[min_change, max_change] on the optimal values
+            report.value_bound = factor*report.span/2.0;
+            report.policy_bound = factor*report.span;
+            report.converged = report.span < tolerance/factor;
+        } else {
+            report.value_bound = factor*report.change;
+            report.policy_bound = 2.0*factor*report.change;
+            if(stop == Stop::CONTRACTION) {
+                report.converged = report.change < tolerance/(2.0*factor);
+            } else {
+                report.converged = report.change < tolerance;
+            }
+        }
+        history.push_back(report.change);
+        // Save a copy of the progress so far in the background, after the previous checkpoint is done
+        if(checkpoint_interval and (i % checkpoint_interval == 0) and not report.converged) {
+            if(writing.valid()) check_written(writing.get(), writing_iteration);
+            writing = std::async(std::launch::async, &Bellman::write_state, this, checkpoint_file,
+                                 value, policy, history, i);
+            writing_iteration = i;
+        }
+        // Every value used by the next iteration is within discount/(1-discount) times the change of optimal,
+        // so the value of each action is known to within discount times that. A Jacobi sweep further
+        // confines the optimal values to a band as wide as that factor times the span of the change
+        if(sweep == Sweep::JACOBI) {
+            margin = discount*factor*report.span;
+        } else {
+            margin = 2.0*discount*factor*report.change;
         }
         // If value converged for all states, finish early
-        if(converged) {
+        if(report.converged) {
+            if(stop == Stop::SPAN) {
+                Real const shift = factor*(max_change + min_change)/2.0;
+                for(Index s=0; s<nS; ++s) {
+                    value[s] += shift;
+                }
+            }
             std::cout << "... Converged at iteration " << i << " of " << iterations << "." << std::endl;
             break;
         }
     }
-    if(not converged) {
+    if(not report.converged) {
         std::cout << "... Finished at max iteration " << iterations << "." << std::endl;
     }
+    // Record the final state once every earlier checkpoint is written
+    if(writing.valid()) check_written(writing.get(), writing_iteration);
+    if(checkpoint_interval) {
+        check_written(write_state(checkpoint_file, value, policy, history, report.iterations), report.iterations);
+    }
+    uint const sweeps = report.iterations - (first - 1);
+    std::chrono::duration<Real, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "(" << sweeps << " sweeps in " << elapsed.count() << " ms, "
+              << elapsed.count()/std::max(sweeps, 1u) << " ms per sweep)" << std::endl;
+    std::cout << "(value within " << report.value_bound << " of optimal, policy within "
+              << report.policy_bound << ")" << std::endl;
+    if(eliminate) {
+        std::cout << "(" << report.skipped << " of " << size_t(sweeps)*nS*nA
+                  << " row evaluations skipped by action elimination)" << std::endl;
+    }
     std::cout << "=================================" << std::endl;
+    return report;
 }
 
 /////////////////////////
 
-Index Bellman::index_from_coords(Vector<uint> const& coords, Vector<uint> const& dims) const {
-    Index index = 0;
-    uint const n = std::min(coords.size(), dims.size());
-    for(uint i=0; i<n; ++i) {
-        index = coords[i] + dims[i]*index;
+void Bellman::checkpoint(std::string const& file, uint interval) {
+    checkpoint_file = file;
+    checkpoint_interval = interval;
+}
+
+/////////////////////////
+
+bool Bellman::write_state(std::string const& file, Vector<Real> const& v, Vector<Index> const& pi,
+                          Vector<Real> const& changes, uint iteration) const {
+    std::string const temporary = file + ".tmp";
+    std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+    // Header identifying the format, the sizes of the stored types, the model's shape and the iteration
+    uint32_t const header[] = {STATE_VERSION, sizeof(Index), sizeof(Real), nS, nA, iteration};
+    stream.write("BELLSTAT", 8);
+    stream.write(reinterpret_cast<char const*>(header), sizeof(header));
+    stream.write(reinterpret_cast<char const*>(&discount), sizeof(discount));
+    write_array(stream, v);
+    write_array(stream, pi);
+    write_array(stream, changes);
+    write_array(stream, permutation);
+    stream.close();
+    if(not stream or (std::rename(temporary.c_str(), file.c_str()) != 0)) {
+        std::remove(temporary.c_str());
+        return false;
     }
-    return index;
+    return true;
 }
 
 /////////////////////////
 
-Vector<uint> Bellman::coords_from_index(Index index, Vector<uint> const& dims) const {
-    Vector<uint> coords(dims.size());
-    for(int i=dims.size()-1; i>=0; --i) {
-        coords[i] = index % dims[i];
-        index /= dims[i];
+bool Bellman::load_state(std::string const& file) {
+    std::ifstream stream(file, std::ios::binary | std::ios::ate);
+    if(not stream) return false;
+    size_t const file_size = stream.tellg();
+    stream.seekg(0);
+    // Accept only a checkpoint written in this format for a model of this shape and numbering
+    char magic[8] = {};
+    uint32_t header[6] = {};
+    Real file_discount = 0.0;
+    stream.read(magic, sizeof(magic));
+    stream.read(reinterpret_cast<char*>(header), sizeof(header));
+    stream.read(reinterpret_cast<char*>(&file_discount), sizeof(file_discount));
+    uint32_t const expected[] = {STATE_VERSION, sizeof(Index), sizeof(Real), nS, nA};
+    Vector<Real> v, changes;
+    Vector<Index> pi, numbering;
+    bool const complete = stream and (std::memcmp(magic, "BELLSTAT", 8) == 0)
+                      and (std::memcmp(header, expected, sizeof(expected)) == 0) and (file_discount == discount)
+                      and read_array(stream, file_size, v)
+                      and read_array(stream, file_size, pi)
+                      and read_array(stream, file_size, changes)
+                      and read_array(stream, file_size, numbering);
+    bool const consistent = complete and (v.size() == nS) and (pi.size() == nS) and (numbering == permutation)
+                        and std::all_of(pi.begin(), pi.end(), [this](Index a) {return a < nA;});
+    if(not consistent) {
+        std::cout << "(Bellman: " << file << " is not a checkpoint of this model)" << std::endl;
+        return false;
     }
-    return coords;
+    value.swap(v);
+    policy.swap(pi);
+    history.swap(changes);
+    resumed = header[5];
+    std::cout << "(Bellman: loaded checkpoint from " << file << " after iteration " << resumed << ")" << std::endl;
+    return true;
 }
 
 /////////////////////////
 
-void Bellman::verify_dynamic() const {
-    std::cout << "(Bellman: verifying dynamic)" << std::endl;
-    // Iterate over all possible starting states
-    for(Index s=0; s<nS; ++s) {
-        // Iterate over all possible actions
-        for(Index a=0; a<nA; ++a) {
-            // Prepare sum of probabilities
-            Real sum = 0.0;
-            // Verify sparse transition matrix if set...
-            if(transitions.size()) {
-                // Sum probabilities for each possible ending state
-                for(std::pair<Index, Real> const& s1_p : transitions.at(s).at(a)) {
-                    sum += s1_p.second;
-                }
-            // ... or verify dynamic function
-            } else {
-                // Sum probabilities for any ending state
-                for(Index s1=0; s1<nS; ++s1) {
-                    sum += dynamic(s, a, s1);
-                }
-            }
-            // Assert that probabilities sum to 1
-            if(fabs(1.0 - sum) > 1e-6) {
-                std::cerr << "================" << std::endl;
-                std::cerr << "Dynamic invalid for state " << s << " and action " << a << ":" << std::endl;
-                std::cerr << "    Got probabilities summing to " << sum << "." << std::endl;
-                std::cerr << "================" << std::endl;
-                throw -1;
-            }
+Report Bellman::improve_mixed(uint iterations, Real tolerance, Stop stop) {
+    // Both precisions sweep in place, for which the span bounds do not hold
+    if(stop == Stop::SPAN) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Mixed-precision improvement cannot use the span stopping rule." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    std::cout << "=================================" << std::endl;
+    std::cout << "Bellman: single-precision improvement beginning..." << std::endl;
+    auto const start = std::chrono::steady_clock::now();
+    // Make the single-precision copies of the probabilities and values
+    if(not transitions.empty() and not transitions.coded() and transitions.single.empty()) {
+        transitions.single.assign(transitions.probabilities.begin(), transitions.probabilities.end());
+    }
+    Vector<float> value_single(value.begin(), value.end());
+    // Iterate in place until the changes meet the stopping rule or approach the rounding error of the values
+    Real const factor = discount/(1.0 - discount);
+    float const threshold = (stop == Stop::DELTA) ? tolerance : tolerance/(2.0*factor);
+    uint i = 0;
+    while(i < iterations) {
+        ++i;
+        float change = 0.0f;
+        float largest = 0.0f;
+        for(Index s=0; s<nS; ++s) {
+            Index best_action;
+            float const best_value = backup(s, value_single, best_action);
+            change = std::max(change, fabsf(best_value - value_single[s]));
+            largest = std::max(largest, fabsf(best_value));
+            value_single[s] = best_value;
+            policy[s] = best_action;
         }
+        if(change < std::max(threshold, 64*std::numeric_limits<float>::epsilon()*largest)) break;
     }
+    std::copy(value_single.begin(), value_single.end(), value.begin());
+    // Release the single-precision probabilities rather than keep the stored model a third larger
+    Vector<float>().swap(transitions.single);
+    std::chrono::duration<Real, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "... Switching to double precision at iteration " << i << " of " << iterations << "." << std::endl;
+    std::cout << "(" << i << " sweeps in " << elapsed.count() << " ms, "
+              << elapsed.count()/i << " ms per sweep)" << std::endl;
+    // Refine in double precision for the remaining iterations, which always needs at least one
+    // to establish the error bounds
+    Report report = improve(std::max(iterations - i, 1u), tolerance, Sweep::GAUSS_SEIDEL, stop);
+    report.iterations += i;
+    return report;
 }
 
-//////////////////////////////////////////////////
+/////////////////////////
 
-void Bellman::analyze_sparsity() {
-    std::cout << "(Bellman: analyzing dynamic sparsity)" << std::endl;
-    // Iterate over all possible starting states
+Report Bellman::improve_prioritized(uint sweeps, Real tolerance) {
+    Report report = {0, false, INF, INF, INF, INF, 0};
+    if(transitions.empty()) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Prioritized sweeping needs the transitions from analyze_sparsity." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    std::cout << "=================================" << std::endl;
+    std::cout << "Bellman: prioritized sweeping beginning..." << std::endl;
+    auto const start = std::chrono::steady_clock::now();
+    // Work with plain ending states
+    bool const encoded = transitions.encoded();
+    transitions.decode();
+    // Index the predecessors of each ending state s1, in the same layout as the transitions but
+    // with rows indexed by s1 alone, each predecessor listed once with its largest probability over actions
+    Transitions predecessors;
+    predecessors.offsets.assign(nS + 1, 0);
     for(Index s=0; s<nS; ++s) {
-        transitions.emplace_back();
-        // Iterate over all possible actions
-        for(Index a=0; a<nA; ++a) {
-            transitions[s].emplace_back();
-            // Iterate over all possible ending states
-            for(Index s1=0; s1<nS; ++s1) {
-                Real p = dynamic(s, a, s1);
-                if(p > 0.0) {
-                    transitions[s][a].emplace_back(s1, p);
+        for(Index k=transitions.offsets[s*nA]; k<transitions.offsets[(s+1)*nA]; ++k) {
+            predecessors.offsets[transitions.states[k] + 1]++;
+        }
+    }
+    for(Index s1=0; s1<nS; ++s1) {
+        predecessors.offsets[s1+1] += predecessors.offsets[s1];
+    }
+    Vector<Index> fill(predecessors.offsets.begin(), predecessors.offsets.end() - 1);
+    predecessors.states.resize(transitions.nonzeros());
+    predecessors.probabilities.resize(transitions.nonzeros());
+    for(Index s=0; s<nS; ++s) {
+        for(Index k=transitions.offsets[s*nA]; k<transitions.offsets[(s+1)*nA]; ++k) {
+            Index const s1 = transitions.states[k];
+            // Merge with the entry just written if the same predecessor reaches s1 by another action
+            if((fill[s1] > predecessors.offsets[s1]) and (predecessors.states[fill[s1]-1] == s)) {
+                predecessors.probabilities[fill[s1]-1] = std::max(predecessors.probabilities[fill[s1]-1],
+                                                                  transitions.probability(k));
+            } else {
+                predecessors.states[fill[s1]] = s;
+                predecessors.probabilities[fill[s1]] = transitions.probability(k);
+                fill[s1]++;
+            }
+        }
+    }
+    // Upper bound on each state's Bellman residual, with the states whose bound is at least the
+    // tolerance queued in buckets by the binary order of magnitude of bound/tolerance, so that
+    // raising a bound is constant-time and popping takes a state within a factor 2 of the largest
+    Vector<Real> priority(nS);
+    Vector<Vector<Index>> buckets(64);
+    Vector<int> bucket(nS, -1); // bucket holding each state, or -1 if not queued
+    Vector<Index> slot(nS); // position of each queued state within its bucket
+    Vector<Real> ceiling(nS, tolerance); // bound at which each state moves up out of its bucket
+    int top = -1; // highest bucket that may be nonempty
+    auto const requeue = [&](Index s) {
+        int const b = (priority[s] < tolerance) ? -1 : std::min(63, ilogb(priority[s]/tolerance));
+        // Remove from the old bucket by moving its last state into the vacated slot
+        if(bucket[s] >= 0) {
+            Vector<Index>& old = buckets[bucket[s]];
+            old[slot[s]] = old.back();
+            slot[old.back()] = slot[s];
+            old.pop_back();
+        }
+        bucket[s] = b;
+        ceiling[s] = (b < 0) ? tolerance : ((b == 63) ? INF : ldexp(tolerance, b+1));
+        if(b >= 0) {
+            slot[s] = buckets[b].size();
+            buckets[b].push_back(s);
+            top = std::max(top, b);
+        }
+    };
+    // Start from the exact residuals, which costs one sweep
+    for(Index s=0; s<nS; ++s) {
+        Index best_action;
+        priority[s] = fabs(backup(s, value, best_action) - value[s]);
+        requeue(s);
+    }
+    size_t updates = nS;
+    size_t const budget = size_t(sweeps)*nS;
+    Vector<Index> batch;
+    while(updates < budget) {
+        while((top >= 0) and buckets[top].empty()) --top;
+        if(top < 0) break;
+        // Take the whole highest bucket of residual bounds, in state order for locality
+        batch.swap(buckets[top]);
+        std::sort(batch.begin(), batch.end());
+        for(Index s : batch) {
+            bucket[s] = -1;
+            ceiling[s] = tolerance;
+        }
+        for(Index s : batch) {
+            // Dequeue the state again if an earlier backup in this batch requeued it
+            priority[s] = 0.0;
+            if(bucket[s] >= 0) {
+                requeue(s);
+            }
+            ++updates;
+            Real const best_value = backup(s, value, policy[s]);
+            Real const change = fabs(best_value - value[s]);
+            value[s] = best_value;
+            // A change in this state's value can change each predecessor's backup by at most discount*p*change
+            for(Index k=predecessors.offsets[s]; k<fill[s]; ++k) {
+                Index const s0 = predecessors.states[k];
+                priority[s0] += discount*predecessors.probabilities[k]*change;
+                if(priority[s0] >= ceiling[s0]) {
+                    requeue(s0);
+                }
+            }
+        }
+        batch.clear();
+    }
+    // Make the policy greedy with respect to the final values, since neighbors may have changed
+    // since each state's last backup
+    for(Index s=0; s<nS; ++s) {
+        backup(s, value, policy[s]);
+    }
+    // Whatever remains bounds the residual of the final value estimate
+    report.iterations = (updates + nS - 1)/nS;
+    report.change = *std::max_element(priority.begin(), priority.end());
+    report.converged = report.change < tolerance;
+    report.value_bound = report.change/(1.0 - discount);
+    report.policy_bound = 2.0*discount*report.change/(1.0 - discount);
+    if(report.converged) {
+        std::cout << "... Converged after " << updates << " state updates." << std::endl;
+    } else {
+        std::cout << "... Finished at max updates " << updates << "." << std::endl;
+    }
+    if(encoded) transitions.encode();
+    std::chrono::duration<Real, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "(" << updates << " state updates, " << Real(updates)/nS << " sweeps' worth, in "
+              << elapsed.count() << " ms)" << std::endl;
+    std::cout << "(value within " << report.value_bound << " of optimal, policy within "
+              << report.policy_bound << ")" << std::endl;
+    std::cout << "=================================" << std::endl;
+    return report;
+}
+
+/////////////////////////
+
+Variants Bellman::improve_many(uint iterations, Real tolerance, Vector<Real> const& discounts,
+                               Vector<Vector<Real>> const& rewards) {
+    uint const K = std::max<size_t>(1, std::max(discounts.size(), rewards.size()));
+    bool valid = not transitions.empty();
+    valid = valid and ((discounts.size() <= 1) or (discounts.size() == K));
+    valid = valid and ((rewards.size() <= 1) or (rewards.size() == K));
+    for(Vector<Real> const& table : rewards) {
+        valid = valid and (table.size() == nS*nA);
+    }
+    if(not valid) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Solving variants needs the transitions from analyze_sparsity, and " << K
+                  << " (or 1) discounts and reward tables of size " << nS*nA << "." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    std::cout << "=================================" << std::endl;
+    std::cout << "Bellman: improvement of " << K << " variants beginning..." << std::endl;
+    auto const start = std::chrono::steady_clock::now();
+    // Lay out the discount of each variant, and its reward for each state-action pair next to the others'
+    Vector<Real> g(K);
+    Vector<Real> r(size_t(nS)*nA*K);
+    for(Index k=0; k<K; ++k) {
+        g[k] = discounts.empty() ? discount : discounts[discounts.size() == 1 ? 0 : k];
+    }
+    for(Index s=0; s<nS; ++s) {
+        for(Index a=0; a<nA; ++a) {
+            for(Index k=0; k<K; ++k) {
+                Real& entry = r[(size_t(s)*nA + a)*K + k];
+                if(not rewards.empty()) entry = rewards[rewards.size() == 1 ? 0 : k][external(s)*nA + a];
+                else if(not this->rewards.empty()) entry = this->rewards[s*nA + a];
+                else entry = reward(external(s), a);
+            }
+        }
+    }
+    // Start every variant from the current value estimate, working on the columns of those still
+    // short of the tolerance, which get dropped from the value matrix as they converge
+    Variants variants = {K, Vector<Real>(size_t(nS)*K), Vector<Index>(size_t(nS)*K, 0), Vector<Report>(K)};
+    Vector<Index> columns(K);
+    for(Index k=0; k<K; ++k) {
+        columns[k] = k;
+    }
+    // Columns are summed in chunks of up to 8 held in registers, so rows are padded to a whole
+    // number of chunks, or to the next power of two when narrower
+    auto const padded = [](uint width) {
+        uint stride = 1;
+        while((stride < width) and (stride < 8)) stride *= 2;
+        return (width + stride - 1)/stride*stride;
+    };
+    Vector<Real> v(size_t(nS)*padded(K), 0.0);
+    Vector<Index> pi(size_t(nS)*padded(K), 0);
+    for(Index s=0; s<nS; ++s) {
+        std::fill(&v[size_t(s)*padded(K)], &v[size_t(s)*padded(K)] + K, value[s]);
+    }
+    // Moves the kept columns of the matrices from the given width down to the kept width, row by row
+    // so that every entry is read before it gets overwritten
+    auto const compact = [&](Vector<bool> const& keep, uint width, uint kept) {
+        for(Index s=0; s<nS; ++s) {
+            uint j1 = 0;
+            for(Index j=0; j<width; ++j) {
+                if(not keep[j]) continue;
+                v[size_t(s)*padded(kept) + j1] = v[size_t(s)*padded(width) + j];
+                pi[size_t(s)*padded(kept) + j1] = pi[size_t(s)*padded(width) + j];
+                ++j1;
+            }
+            std::fill(&v[size_t(s)*padded(kept) + kept], &v[size_t(s)*padded(kept)] + padded(kept), 0.0);
+        }
+    };
+    Vector<Real> best(K), max_change(K), min_change(K);
+    Vector<Index> best_action(K);
+    for(uint i=1; (i<=iterations) and not columns.empty(); ++i) {
+        uint const width = columns.size();
+        uint const stride = padded(width);
+        uint const chunk = std::min(stride, 8u);
+        std::fill(max_change.begin(), max_change.end(), -INF);
+        std::fill(min_change.begin(), min_change.end(), INF);
+        for(Index s=0; s<nS; ++s) {
+            std::fill(best.begin(), best.begin() + width, -INF);
+            for(Index a=0; a<nA; ++a) {
+                for(Index j0=0; j0<width; j0+=chunk) {
+                    // Accumulate the expected next value of a chunk of columns in one pass over the row
+                    Real sums[8];
+                    if(chunk == 8) sum_columns<8>(s*nA + a, &v[j0], stride, sums);
+                    else if(chunk == 4) sum_columns<4>(s*nA + a, &v[j0], stride, sums);
+                    else if(chunk == 2) sum_columns<2>(s*nA + a, &v[j0], stride, sums);
+                    else sum_columns<1>(s*nA + a, &v[j0], stride, sums);
+                    for(Index j=j0; j<std::min(j0 + chunk, width); ++j) {
+                        Real const candidate = r[(size_t(s)*nA + a)*K + columns[j]] + g[columns[j]]*sums[j - j0];
+                        if(candidate > best[j]) {
+                            best[j] = candidate;
+                            best_action[j] = a;
+                        }
+                    }
+                }
+            }
+            // Fixed-point iterate on value for this starting state
+            for(Index j=0; j<width; ++j) {
+                Real& current = v[size_t(s)*stride + j];
+                max_change[j] = std::max(max_change[j], best[j] - current);
+                min_change[j] = std::min(min_change[j], best[j] - current);
+                current = best[j];
+                pi[size_t(s)*stride + j] = best_action[j];
+            }
+        }
+        // Bound each variant's distance to optimal like improve does, and retire the converged ones
+        Vector<bool> keep(width, true);
+        Vector<Index> remaining;
+        for(Index j=0; j<width; ++j) {
+            Index const k = columns[j];
+            Report& report = variants.reports[k];
+            Real const factor = g[k]/(1.0 - g[k]);
+            report.iterations = i;
+            report.change = std::max(max_change[j], -min_change[j]);
+            report.span = max_change[j] - min_change[j];
+            report.value_bound = factor*report.change;
+            report.policy_bound = 2.0*factor*report.change;
+            report.converged = report.change < tolerance;
+            keep[j] = not report.converged and (i < iterations);
+            if(keep[j]) {
+                remaining.push_back(k);
+                continue;
+            }
+            for(Index s=0; s<nS; ++s) {
+                variants.value[size_t(s)*K + k] = v[size_t(s)*stride + j];
+                variants.policy[size_t(s)*K + k] = pi[size_t(s)*stride + j];
+            }
+        }
+        if(remaining.size() < width) {
+            compact(keep, width, remaining.size());
+            columns.swap(remaining);
+        }
+    }
+    // Report in the model's own state numbering
+    if(not permutation.empty()) {
+        Vector<Real> const v_internal = variants.value;
+        Vector<Index> const pi_internal = variants.policy;
+        for(Index s=0; s<nS; ++s) {
+            std::copy(&v_internal[size_t(internal(s))*K], &v_internal[size_t(internal(s))*K] + K, &variants.value[size_t(s)*K]);
+            std::copy(&pi_internal[size_t(internal(s))*K], &pi_internal[size_t(internal(s))*K] + K, &variants.policy[size_t(s)*K]);
+        }
+    }
+    std::chrono::duration<Real, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    uint converged = 0;
+    for(Report const& report : variants.reports) {
+        converged += report.converged;
+    }
+    std::cout << "... " << converged << " of " << K << " variants converged." << std::endl;
+    std::cout << "(" << elapsed.count() << " ms)" << std::endl;
+    std::cout << "=================================" << std::endl;
+    return variants;
+}
+
+/////////////////////////
+
+Report Bellman::improve_topological(uint iterations, Real tolerance) {
+    Report report = {0, true, 0.0, INF, INF, INF, 0};
+    if(transitions.empty()) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Topological value iteration needs the transitions from analyze_sparsity." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    std::cout << "=================================" << std::endl;
+    std::cout << "Bellman: topological value iteration beginning..." << std::endl;
+    auto const start = std::chrono::steady_clock::now();
+    // Work with plain ending states
+    bool const encoded = transitions.encoded();
+    transitions.decode();
+    // Find the strongly connected components with Tarjan's algorithm, using an explicit call stack
+    // of (state, next transition to follow). Components are completed in reverse topological order,
+    // and are stored as consecutive runs of the order array starting at the positions in starts
+    Index constexpr UNVISITED = std::numeric_limits<Index>::max();
+    Vector<Index> discovery(nS, UNVISITED), lowlink(nS);
+    Vector<bool> on_stack(nS, false);
+    Vector<Index> stack, order, starts = {0};
+    Vector<std::pair<Index, Index>> calls;
+    Index counter = 0;
+    auto const visit = [&](Index s) {
+        discovery[s] = lowlink[s] = counter++;
+        stack.push_back(s);
+        on_stack[s] = true;
+        calls.emplace_back(s, transitions.offsets[s*nA]);
+    };
+    for(Index root=0; root<nS; ++root) {
+        if(discovery[root] != UNVISITED) continue;
+        visit(root);
+        while(not calls.empty()) {
+            Index const s = calls.back().first;
+            if(calls.back().second < transitions.offsets[(s+1)*nA]) {
+                // Follow the next transition out of s
+                Index const s1 = transitions.states[calls.back().second++];
+                if(discovery[s1] == UNVISITED) {
+                    visit(s1);
+                } else if(on_stack[s1]) {
+                    lowlink[s] = std::min(lowlink[s], discovery[s1]);
+                }
+            } else {
+                // Finished with s, so pass its lowlink up and close its component if it is the root
+                calls.pop_back();
+                if(not calls.empty()) {
+                    lowlink[calls.back().first] = std::min(lowlink[calls.back().first], lowlink[s]);
+                }
+                if(lowlink[s] == discovery[s]) {
+                    Index s1;
+                    do {
+                        s1 = stack.back();
+                        stack.pop_back();
+                        on_stack[s1] = false;
+                        order.push_back(s1);
+                    } while(s1 != s);
+                    starts.push_back(order.size());
+                }
+            }
+        }
+    }
+    // Report the component sizes by decade
+    Index const components = starts.size() - 1;
+    Vector<Index> decades;
+    Index largest = 0;
+    for(Index c=0; c<components; ++c) {
+        Index const size = starts[c+1] - starts[c];
+        largest = std::max(largest, size);
+        uint const decade = log10(size);
+        if(decades.size() <= decade) decades.resize(decade + 1, 0);
+        decades[decade]++;
+    }
+    std::cout << "(" << components << " strongly connected components, largest has " << largest << " states)" << std::endl;
+    for(uint decade=0; decade<decades.size(); ++decade) {
+        std::cout << "(" << decades[decade] << " with " << pow(10, decade) << " to " << pow(10, decade+1)-1
+                  << " states)" << std::endl;
+    }
+    // Solve each component against the already-final values of the components it leads to
+    size_t updates = 0;
+    Real const factor = discount/(1.0 - discount);
+    for(Index c=0; c<components; ++c) {
+        bool converged = false;
+        Real change = INF;
+        for(uint i=1; (i <= iterations) and not converged; ++i) {
+            change = 0.0;
+            for(Index k=starts[c]; k<starts[c+1]; ++k) {
+                Index const s = order[k];
+                Index best_action;
+                Real const best_value = backup(s, value, best_action);
+                change = std::max(change, fabs(best_value - value[s]));
+                value[s] = best_value;
+                policy[s] = best_action;
+            }
+            updates += starts[c+1] - starts[c];
+            converged = change < tolerance;
+        }
+        // The overall bounds are those of the least converged component
+        report.converged = report.converged and converged;
+        report.change = std::max(report.change, change);
+    }
+    report.iterations = (updates + nS - 1)/nS;
+    report.value_bound = factor*report.change;
+    report.policy_bound = 2.0*factor*report.change;
+    if(report.converged) {
+        std::cout << "... Converged after " << updates << " state updates." << std::endl;
+    } else {
+        std::cout << "... Finished with some components at max iteration " << iterations << "." << std::endl;
+    }
+    if(encoded) transitions.encode();
+    std::chrono::duration<Real, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "(" << updates << " state updates, " << Real(updates)/nS << " sweeps' worth, in "
+              << elapsed.count() << " ms)" << std::endl;
+    std::cout << "(value within " << report.value_bound << " of optimal, policy within "
+              << report.policy_bound << ")" << std::endl;
+    std::cout << "=================================" << std::endl;
+    return report;
+}
+
+/////////////////////////
+
+Report Bellman::improve_streamed(std::string const& file, uint64_t key, uint iterations, Real tolerance, size_t block_bytes) {
+    Report report = {0, false, INF, INF, INF, INF, 0};
+    // Read the per-row arrays and small tables, and note where the per-nonzero arrays are
+    std::ifstream stream;
+    size_t file_size = 0;
+    Transitions rows;
+    Section states, deltas, probabilities, codes8, codes16;
+    Vector<Real> file_rewards;
+    Vector<Index> file_permutation, file_original;
+    bool valid = open_model(stream, file, key, file_size)
+             and read_array(stream, file_size, rows.offsets)
+             and skip_array<Index>(stream, file_size, states)
+             and read_array(stream, file_size, rows.bases)
+             and skip_array<uint16_t>(stream, file_size, deltas)
+             and skip_array<Real>(stream, file_size, probabilities)
+             and read_array(stream, file_size, rows.dictionary)
+             and skip_array<uint8_t>(stream, file_size, codes8)
+             and skip_array<uint16_t>(stream, file_size, codes16)
+             and read_array(stream, file_size, file_rewards)
+             and read_array(stream, file_size, file_permutation)
+             and read_array(stream, file_size, file_original);
+    valid = valid and not rows.offsets.empty()
+                  and fits_model(rows.offsets, rows.bases, states.size, deltas.size, probabilities.size,
+                                 rows.dictionary.size(), codes8.size, codes16.size, file_rewards.size(),
+                                 file_permutation, file_original);
+    if(not valid) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Streamed improvement needs the transitions saved by save_model for this model in " << file << "." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    // Take the file's numbering of the states, carrying the values and everything else over to it,
+    // unless the model stores transitions in a different one
+    if(file_permutation != permutation) {
+        if(not transitions.empty()) {
+            std::cerr << "================" << std::endl;
+            std::cerr << "The states in " << file << " are numbered differently from the stored transitions." << std::endl;
+            std::cerr << "================" << std::endl;
+            throw -1;
+        }
+        renumber(file_permutation, file_original);
+    }
+    // Split the states into blocks whose nonzeros take up about block_bytes each, and at least one state
+    size_t const nonzero_bytes = (states.size ? sizeof(Index) : sizeof(uint16_t))
+                               + (probabilities.size ? sizeof(Real) : codes8.size ? sizeof(uint8_t) : sizeof(uint16_t));
+    Vector<Index> const blocks = split_states(rows.offsets, block_bytes/nonzero_bytes);
+    uint const nB = blocks.size() - 1;
+    // Fills the given buffer with the transitions of block b, its rows numbered from the block's first
+    auto const read_block = [&](uint b, Transitions& block) {
+        Index const r0 = blocks[b]*nA;
+        Index const r1 = blocks[b+1]*nA;
+        Index const k0 = rows.offsets[r0];
+        Index const count = rows.offsets[r1] - k0;
+        block.offsets.resize(r1 - r0 + 1);
+        for(Index r=r0; r<=r1; ++r) {
+            block.offsets[r - r0] = rows.offsets[r] - k0;
+        }
+        if(rows.encoded()) block.bases.assign(rows.bases.begin() + r0, rows.bases.begin() + r1);
+        return read_slice(stream, states, k0, count, block.states)
+           and read_slice(stream, deltas, k0, count, block.deltas)
+           and read_slice(stream, probabilities, k0, count, block.probabilities)
+           and read_slice(stream, codes8, k0, count, block.codes8)
+           and read_slice(stream, codes16, k0, count, block.codes16)
+           and fits_states(block);
+    };
+    // Backs up the states of block b in place, from its transitions in the given buffer
+    auto const sweep_block = [&](uint b, Transitions const& block, Real& max_change, Real& min_change) {
+        for(Index s=blocks[b]; s<blocks[b+1]; ++s) {
+            Real best_value = -INF;
+            Index best_action = 0;
+            for(Index a=0; a<nA; ++a) {
+                if(not is_active(s, a)) continue;
+                Index const row = s*nA + a;
+                Real const r = file_rewards.empty() ? reward(external(s), a) : file_rewards[row];
+                Real const candidate = r + discount*sparse_expectation(block, row - blocks[b]*nA, value);
+                if(candidate > best_value) {
+                    best_value = candidate;
+                    best_action = a;
+                }
+            }
+            max_change = std::max(max_change, best_value - value[s]);
+            min_change = std::min(min_change, best_value - value[s]);
+            value[s] = best_value;
+            policy[s] = best_action;
+        }
+    };
+    std::cout << "=================================" << std::endl;
+    std::cout << "Bellman: streamed improvement beginning..." << std::endl;
+    std::cout << "(streaming " << rows.nonzeros() << " nonzero transitions from " << file << " in " << nB
+              << " blocks)" << std::endl;
+    auto const start = std::chrono::steady_clock::now();
+    // Double buffer, one holding the block being backed up and the other the block being read
+    Transitions buffers[2];
+    buffers[0].dictionary = buffers[1].dictionary = rows.dictionary;
+    uint current = 0;
+    bool complete = read_block(0, buffers[current]);
+    for(uint i=1; complete and (i<=iterations); ++i) {
+        report.iterations = i;
+        // Alert user of progress
+        if(fmod(100.0*i/iterations, 20.0) == 0.0) {
+            std::cout << "(" << i << " / " << iterations << ")" << std::endl;
+        }
+        Real max_change = -INF;
+        Real min_change = INF;
+        for(uint b=0; b<nB; ++b) {
+            // Read the following block, wrapping around to the next sweep's first, unless there is only this one
+            bool const prefetch = nB > 1;
+            bool read = true;
+            #pragma omp parallel sections num_threads(2) if(prefetch)
+            {
+                #pragma omp section
+                {
+                    if(prefetch) read = read_block((b+1) % nB, buffers[1 - current]);
+                }
+                #pragma omp section
+                {
+                    sweep_block(b, buffers[current], max_change, min_change);
+                }
+            }
+            complete = complete and read;
+            if(prefetch) current = 1 - current;
+        }
+        // Bound the distance to the optimal value function by the contraction property
+        Real const factor = discount/(1.0 - discount);
+        report.change = std::max(max_change, -min_change);
+        report.span = max_change - min_change;
+        report.value_bound = factor*report.change;
+        report.policy_bound = 2.0*factor*report.change;
+        report.converged = report.change < tolerance;
+        // If value converged for all states, finish early
+        if(report.converged) {
+            std::cout << "... Converged at iteration " << i << " of " << iterations << "." << std::endl;
+            break;
+        }
+    }
+    if(not complete) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Could not read consistent transitions from " << file << " during streamed improvement." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    if(not report.converged) {
+        std::cout << "... Finished at max iteration " << iterations << "." << std::endl;
+    }
+    std::chrono::duration<Real, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "(" << report.iterations << " sweeps in " << elapsed.count() << " ms, "
+              << elapsed.count()/report.iterations << " ms per sweep)" << std::endl;
+    std::cout << "(value within " << report.value_bound << " of optimal, policy within "
+              << report.policy_bound << ")" << std::endl;
+    std::cout << "=================================" << std::endl;
+    return report;
+}
+
+/////////////////////////
+
+void Bellman::improve_policy(uint iterations, Real tolerance, uint evaluations, Evaluation evaluation) {
+    bool converged;
+    std::cout << "=================================" << std::endl;
+    std::cout << "Bellman: policy iteration beginning..." << std::endl;
+    // Time the iterations and count every sweep over the state space, including evaluations
+    auto const start = std::chrono::steady_clock::now();
+    uint sweeps = 0;
+    for(uint i=1; i<=iterations; ++i) {
+        // Alert user of progress
+        if(fmod(100.0*i/iterations, 20.0) == 0.0) {
+            std::cout << "(" << i << " / " << iterations << ")" << std::endl;
+        }
+        // Assume converged unless any values prove to still be changing
+        converged = true;
+        // Improve the policy greedily with respect to the current value estimate
+        ++sweeps;
+        for(Index s=0; s<nS; ++s) {
+            Index best_action;
+            Real const best_value = backup(s, value, best_action);
+            // Check convergence of this state's value
+            converged = converged and (fabs(value[s] - best_value) < tolerance);
+            value[s] = best_value;
+            policy[s] = best_action;
+        }
+        // If value converged for all states, finish early
+        if(converged) {
+            std::cout << "... Converged at iteration " << i << " of " << iterations << "." << std::endl;
+            break;
+        }
+        // Evaluate the improved policy
+        if(evaluation == Evaluation::BICGSTAB) {
+            sweeps += evaluate_policy_bicgstab(evaluations, tolerance);
+        } else {
+            sweeps += evaluate_policy(evaluations, tolerance);
+        }
+    }
+    if(not converged) {
+        std::cout << "... Finished at max iteration " << iterations << "." << std::endl;
+    }
+    std::chrono::duration<Real, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "(" << sweeps << " sweeps in " << elapsed.count() << " ms)" << std::endl;
+    std::cout << "=================================" << std::endl;
+}
+
+/////////////////////////
+
+uint Bellman::evaluate_policy(uint sweeps, Real tolerance) {
+    uint sweep = 0;
+    bool converged = false;
+    while((sweeps == 0) ? not converged : (sweep < sweeps)) {
+        ++sweep;
+        // Assume converged unless any values prove to still be changing
+        converged = true;
+        // Iterate over starting states
+        for(Index s=0; s<nS; ++s) {
+            Real const policy_value = evaluate(s, policy[s], value);
+            // Check convergence of this state's value
+            converged = converged and (fabs(value[s] - policy_value) < tolerance);
+            // Fixed-point iterate on value for this starting state under the fixed policy
+            value[s] = policy_value;
+        }
+    }
+    return sweep;
+}
+
+/////////////////////////
+
+uint Bellman::evaluate_policy_bicgstab(uint iterations, Real tolerance) {
+    // Applies the policy's operator (I - discount*P) to x, using that evaluate(s, a, x) = r + discount*P*x
+    Vector<Real> const zero(nS, 0.0);
+    Vector<Real> r_policy(nS);
+    #pragma omp parallel for schedule(static)
+    for(Index s=0; s<nS; ++s) {
+        r_policy[s] = evaluate(s, policy[s], zero);
+    }
+    uint applications = 0;
+    auto const apply = [&](Vector<Real> const& x, Vector<Real>& out) {
+        ++applications;
+        #pragma omp parallel for schedule(static)
+        for(Index s=0; s<nS; ++s) {
+            out[s] = x[s] - (evaluate(s, policy[s], x) - r_policy[s]);
+        }
+    };
+    // Reductions over the state space
+    auto const dot = [this](Vector<Real> const& x, Vector<Real> const& y) {
+        Real sum = 0.0;
+        #pragma omp parallel for schedule(static) reduction(+:sum)
+        for(Index s=0; s<nS; ++s) {
+            sum += x[s]*y[s];
+        }
+        return sum;
+    };
+    auto const norm = [this](Vector<Real> const& x) {
+        Real sup = 0.0;
+        #pragma omp parallel for schedule(static) reduction(max:sup)
+        for(Index s=0; s<nS; ++s) {
+            sup = std::max(sup, fabs(x[s]));
+        }
+        return sup;
+    };
+    // Initial residual r = b - A*x from the warm start x = value
+    Vector<Real> r(nS), r0(nS), p(nS, 0.0), v(nS, 0.0), h(nS), t(nS);
+    apply(value, r);
+    for(Index s=0; s<nS; ++s) {
+        r[s] = r_policy[s] - r[s];
+    }
+    r0 = r;
+    Real rho = 1.0, alpha = 1.0, omega = 1.0;
+    for(uint i=1; (iterations == 0) or (i <= iterations); ++i) {
+        if(norm(r) < tolerance) break;
+        Real const rho_next = dot(r0, r);
+        // Restart the shadow residual on breakdown
+        if(rho_next == 0.0) {
+            r0 = r;
+            rho = alpha = omega = 1.0;
+            std::fill(p.begin(), p.end(), 0.0);
+            std::fill(v.begin(), v.end(), 0.0);
+            continue;
+        }
+        Real const beta = (rho_next/rho)*(alpha/omega);
+        rho = rho_next;
+        for(Index s=0; s<nS; ++s) {
+            p[s] = r[s] + beta*(p[s] - omega*v[s]);
+        }
+        apply(p, v);
+        alpha = rho/dot(r0, v);
+        // Half step, which may already be accurate enough
+        for(Index s=0; s<nS; ++s) {
+            value[s] += alpha*p[s];
+            h[s] = r[s] - alpha*v[s];
+        }
+        if(norm(h) < tolerance) {
+            r.swap(h);
+            break;
+        }
+        apply(h, t);
+        Real const tt = dot(t, t);
+        omega = (tt > 0.0) ? dot(t, h)/tt : 0.0;
+        // Full step
+        for(Index s=0; s<nS; ++s) {
+            value[s] += omega*h[s];
+            r[s] = h[s] - omega*t[s];
+        }
+        if(omega == 0.0) break;
+    }
+    return applications;
+}
+
+/////////////////////////
+
+Real Bellman::backup(Index s, Vector<Real> const& v, Index& best_action) const {
+    return backup_with(s, v, best_action,
+                       [this](Index s, Index a) {return reward(s, a);},
+                       [this](Index s, Index a, Index s1) {return dynamic(s, a, s1);},
+                       [this](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+                           factor_successors(s, a, f, out);
+                       });
+}
+
+/////////////////////////
+
+float Bellman::backup(Index s, Vector<float> const& v, Index& best_action) const {
+    return backup_with(s, v, best_action,
+                       [this](Index s, Index a) {return reward(s, a);},
+                       [this](Index s, Index a, Index s1) {return dynamic(s, a, s1);},
+                       [this](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+                           factor_successors(s, a, f, out);
+                       });
+}
+
+/////////////////////////
+
+void Bellman::backup_all(Vector<Real> const& v, Vector<Real>& next) {
+    #pragma omp parallel for schedule(static)
+    for(Index s=0; s<nS; ++s) {
+        next[s] = backup(s, v, policy[s]);
+    }
+}
+
+/////////////////////////
+
+template <class V, class RewardFn, class DynamicFn, class FactorFn>
+V Bellman::backup_with(Index s, Vector<V> const& v, Index& best_action,
+                       RewardFn const& reward_fn, DynamicFn const& dynamic_fn, FactorFn const& factor_fn) const {
+    // Prepare to maximize over actions
+    V best_value = -INF;
+    best_action = 0;
+    // Iterate over action choices that have not been eliminated
+    for(Index a=0; a<nA; ++a) {
+        if(not is_active(s, a)) continue;
+        // Compare candidate to best so far
+        V candidate = evaluate_with(s, a, v, reward_fn, dynamic_fn, factor_fn);
+        if(candidate > best_value) {
+            best_value = candidate;
+            best_action = a;
+        }
+    }
+    return best_value;
+}
+
+/////////////////////////
+
+Real Bellman::evaluate(Index s, Index a, Vector<Real> const& v) const {
+    return evaluate_with(s, a, v,
+                         [this](Index s, Index a) {return reward(s, a);},
+                         [this](Index s, Index a, Index s1) {return dynamic(s, a, s1);},
+                         [this](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+                             factor_successors(s, a, f, out);
+                         });
+}
+
+/////////////////////////
+
+template <class V, class RewardFn, class DynamicFn, class FactorFn>
+V Bellman::evaluate_with(Index s, Index a, Vector<V> const& v,
+                         RewardFn const& reward_fn, DynamicFn const& dynamic_fn, FactorFn const& factor_fn) const {
+    // Prepare to compute expected next value
+    V expectation = 0.0;
+    // Iterate over ending states to accrue expectation integral
+    if(not transitions.empty()) {
+        // Leverage sparsity to sum only possible transitions
+        expectation = sparse_expectation(transitions, s*nA + a, v);
+    } else if(not factors.empty()) {
+        // Gather the small kernel of each factor, reusing each thread's scratch space
+        thread_local Vector<Vector<std::pair<Index, Real>>> kernels;
+        kernels.resize(factors.size());
+        for(uint f=0; f<factors.size(); ++f) {
+            kernels[f].clear();
+            factor_fn(external(s), a, f, kernels[f]);
+        }
+        expectation = contract(kernels, 0, 0, v);
+    } else {
+        // Sum over all ending states
+        for(Index s1=0; s1<nS; ++s1) {
+            expectation += V(dynamic_fn(external(s), a, external(s1))) * v[s1];
+        }
+    }
+    return V(rewards.empty() ? reward_fn(external(s), a) : rewards[s*nA + a]) + V(discount)*expectation;
+}
+
+/////////////////////////
+
+template <class V>
+V Bellman::sparse_expectation(Transitions const& t, Index row, Vector<V> const& v) {
+    if(not t.codes8.empty()) {
+        // Decode each probability through the dictionary
+        Vector<V> const& dictionary = t.dictionary_for(V());
+        Vector<uint8_t> const& codes = t.codes8;
+        return expectation_with(t, row, v, [&](Index k) {return dictionary[codes[k]];});
+    } else if(not t.codes16.empty()) {
+        Vector<V> const& dictionary = t.dictionary_for(V());
+        Vector<uint16_t> const& codes = t.codes16;
+        return expectation_with(t, row, v, [&](Index k) {return dictionary[codes[k]];});
+    } else {
+        Vector<V> const& probabilities = t.probabilities_for(V());
+        return expectation_with(t, row, v, [&](Index k) {return probabilities[k];});
+    }
+}
+
+/////////////////////////
+
+Real Bellman::sparse_expectation(Transitions const& t, Index row, Vector<Real> const& v) {
+#ifdef BELLMAN_AVX2
+    // Gather four nonzeros at a time if the CPU allows, for plain ending states in rows long
+    // enough to pay for the gathers and the call
+    Index const begin = t.offsets[row];
+    Index const end = t.offsets[row+1];
+    if((end - begin >= avx2::MIN_NONZEROS) and avx2::supported() and not t.encoded()) {
+        Index const* states = t.states.data();
+        if(not t.codes8.empty()) {
+            return avx2::dot(begin, end, states, avx2::Coded8{t.codes8.data(), t.dictionary.data()}, v.data());
+        } else if(not t.codes16.empty()) {
+            return avx2::dot(begin, end, states, avx2::Coded16{t.codes16.data(), t.dictionary.data()}, v.data());
+        } else {
+            return avx2::dot(begin, end, states, avx2::Plain{t.probabilities.data()}, v.data());
+        }
+    }
+#endif
+    return sparse_expectation<Real>(t, row, v);
+}
+
+/////////////////////////
+
+template <class V, class ProbabilityFn>
+V Bellman::expectation_with(Transitions const& t, Index row, Vector<V> const& v, ProbabilityFn const& probability_fn) {
+    V expectation = 0.0;
+    Index const begin = t.offsets[row];
+    Index const end = t.offsets[row+1];
+    if(t.encoded()) {
+        // Accumulate the deltas into each ending state
+        Index s1 = t.bases[row];
+        for(Index k=begin; k<end; ++k) {
+            s1 += t.deltas[k];
+            expectation += probability_fn(k) * v[s1];
+        }
+    } else {
+        for(Index k=begin; k<end; ++k) {
+            expectation += probability_fn(k) * v[t.states[k]];
+        }
+    }
+    return expectation;
+}
+
+/////////////////////////
+
+template <class V>
+V Bellman::contract(Vector<Vector<std::pair<Index, Real>>> const& kernels, uint f, Index base, Vector<V> const& v) const {
+    V expectation = 0.0;
+    if(f+1 == factors.size()) {
+        // Innermost factor reads the values directly
+        for(std::pair<Index, Real> const& x_p : kernels[f]) {
+            expectation += V(x_p.second) * v[internal(base + x_p.first)];
+        }
+    } else {
+        // Sum out the inner factors first, for each value of this one
+        for(std::pair<Index, Real> const& x_p : kernels[f]) {
+            expectation += V(x_p.second) * contract(kernels, f+1, (base + x_p.first)*factors[f+1], v);
+        }
+    }
+    return expectation;
+}
+
+/////////////////////////
+
+template <class Fn>
+void Bellman::for_each_transition(Index row, Fn const& fn) const {
+    if(not transitions.codes8.empty()) {
+        Vector<Real> const& dictionary = transitions.dictionary;
+        Vector<uint8_t> const& codes = transitions.codes8;
+        for_each_transition_with(row, [&](Index k) {return dictionary[codes[k]];}, fn);
+    } else if(not transitions.codes16.empty()) {
+        Vector<Real> const& dictionary = transitions.dictionary;
+        Vector<uint16_t> const& codes = transitions.codes16;
+        for_each_transition_with(row, [&](Index k) {return dictionary[codes[k]];}, fn);
+    } else {
+        Vector<Real> const& probabilities = transitions.probabilities;
+        for_each_transition_with(row, [&](Index k) {return probabilities[k];}, fn);
+    }
+}
+
+/////////////////////////
+
+template <class ProbabilityFn, class Fn>
+void Bellman::for_each_transition_with(Index row, ProbabilityFn const& probability_fn, Fn const& fn) const {
+    Index const begin = transitions.offsets[row];
+    Index const end = transitions.offsets[row+1];
+    if(transitions.encoded()) {
+        Index s1 = transitions.bases[row];
+        for(Index k=begin; k<end; ++k) {
+            s1 += transitions.deltas[k];
+            fn(s1, probability_fn(k));
+        }
+    } else {
+        for(Index k=begin; k<end; ++k) {
+            fn(transitions.states[k], probability_fn(k));
+        }
+    }
+}
+
+/////////////////////////
+
+template <Index W>
+void Bellman::sum_columns(Index row, Real const* v, uint stride, Real* sums) const {
+    Real local[W] = {};
+    for_each_transition(row, [&](Index s1, Real p) {
+        Real const* const v1 = v + size_t(s1)*stride;
+        for(Index j=0; j<W; ++j) {
+            local[j] += p * v1[j];
+        }
+    });
+    std::copy(local, local + W, sums);
+}
+
+/////////////////////////
+
+Real Bellman::eliminate(Index s, Vector<Real> const& v, Index& best_action, Real margin) {
+    return eliminate_with(s, v, best_action, margin,
+                          [this](Index s, Index a) {return reward(s, a);},
+                          [this](Index s, Index a, Index s1) {return dynamic(s, a, s1);},
+                          [this](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+                              factor_successors(s, a, f, out);
+                          });
+}
+
+/////////////////////////
+
+template <class RewardFn, class DynamicFn, class FactorFn>
+Real Bellman::eliminate_with(Index s, Vector<Real> const& v, Index& best_action, Real margin,
+                             RewardFn const& reward_fn, DynamicFn const& dynamic_fn, FactorFn const& factor_fn) {
+    // Start from the incumbent action, which is likely the best, to eliminate others as early as possible
+    Index const incumbent = best_action;
+    Real best_value = evaluate_with(s, incumbent, v, reward_fn, dynamic_fn, factor_fn);
+    // Iterate over the other action choices that have not been eliminated
+    for(Index a=0; a<nA; ++a) {
+        if((a == incumbent) or not is_active(s, a)) continue;
+        Real candidate = evaluate_with(s, a, v, reward_fn, dynamic_fn, factor_fn);
+        // Compare candidate to best so far
+        if(candidate > best_value) {
+            best_value = candidate;
+            best_action = a;
+        }
+        // The best value only grows, so this action is already dominated for good
+        else if(candidate < best_value - margin) {
+            active[s] &= ~(uint64_t(1) << a);
+        }
+    }
+    return best_value;
+}
+
+/////////////////////////
+
+Index Bellman::index_from_coords(Vector<uint> const& coords, Vector<uint> const& dims) const {
+    Index index = 0;
+    uint const n = std::min(coords.size(), dims.size());
+    for(uint i=0; i<n; ++i) {
+        index = coords[i] + dims[i]*index;
+    }
+    return index;
+}
+
+/////////////////////////
+
+Vector<uint> Bellman::coords_from_index(Index index, Vector<uint> const& dims) const {
+    Vector<uint> coords(dims.size());
+    for(int i=dims.size()-1; i>=0; --i) {
+        coords[i] = index % dims[i];
+        index /= dims[i];
+    }
+    return coords;
+}
+
+/////////////////////////
+
+void Bellman::verify_dynamic() const {
+    std::cout << "(Bellman: verifying dynamic)" << std::endl;
+    // Sums the probabilities of all ending states for state s and action a
+    auto const total = [this](Index s, Index a) {
+        Real sum = 0.0;
+        // Verify sparse transition matrix if set...
+        if(not transitions.empty()) {
+            // Sum probabilities for each possible ending state
+            Index const row = s*nA + a;
+            for(Index k=transitions.offsets.at(row); k<transitions.offsets.at(row+1); ++k) {
+                sum += transitions.probability(k);
+            }
+        // ... or the kernel of each factor if declared...
+        } else if(not factors.empty()) {
+            Vector<std::pair<Index, Real>> kernel;
+            sum = 1.0;
+            for(uint f=0; f<factors.size(); ++f) {
+                kernel.clear();
+                factor_successors(external(s), a, f, kernel);
+                Real factor_sum = 0.0;
+                for(std::pair<Index, Real> const& x_p : kernel) {
+                    factor_sum += x_p.second;
+                }
+                sum *= factor_sum;
+            }
+        // ... or verify dynamic function
+        } else {
+            // Sum probabilities for any ending state
+            for(Index s1=0; s1<nS; ++s1) {
+                sum += dynamic(external(s), a, s1);
+            }
+        }
+        return sum;
+    };
+    // Find the first state-action row whose probabilities do not sum to 1, or nS*nA if none
+    Index invalid = nS*nA;
+    // Iterate over all possible starting states in parallel
+    #pragma omp parallel for schedule(dynamic, 64) reduction(min:invalid)
+    for(Index s=0; s<nS; ++s) {
+        // Iterate over all possible actions
+        for(Index a=0; a<nA; ++a) {
+            if(fabs(1.0 - total(s, a)) > 1e-6) {
+                invalid = std::min(invalid, s*nA + a);
+            }
+        }
+    }
+    // Assert that probabilities sum to 1
+    if(invalid < nS*nA) {
+        Index const s = invalid / nA;
+        Index const a = invalid % nA;
+        std::cerr << "================" << std::endl;
+        std::cerr << "Dynamic invalid for state " << external(s) << " and action " << a << ":" << std::endl;
+        std::cerr << "    Got probabilities summing to " << total(s, a) << "." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+}
+
+//////////////////////////////////////////////////
+
+void Bellman::analyze_sparsity() {
+    std::cout << "(Bellman: analyzing dynamic sparsity)" << std::endl;
+    // Start from an empty matrix, first recording the length of each row one past its start
+    transitions = Transitions();
+    transitions.offsets.assign(nS*nA + 1, 0);
+    // Distinct probabilities merged from all threads, given up on once too many for codes
+    std::unordered_set<Real> distinct;
+    bool few = true;
+    #pragma omp parallel
+    {
+        // Give each thread its own contiguous block of starting states
+        uint thread = 0;
+        uint threads = 1;
+#ifdef _OPENMP
+        thread = omp_get_thread_num();
+        threads = omp_get_num_threads();
+#endif
+        Index const first = (size_t(nS)*thread)/threads;
+        Index const last = (size_t(nS)*(thread+1))/threads;
+        // Thread-local rows for this block of starting states
+        Vector<Index> states;
+        Vector<Real> probabilities;
+        // Distinct probabilities of this block, likewise given up on once too many
+        std::unordered_set<Real> seen;
+        bool few_here = true;
+        // Scratch space for the successors of one state-action pair
+        Vector<std::pair<Index, Real>> row;
+        // Iterate over this thread's starting states
+        for(Index s=first; s<last; ++s) {
+            // Iterate over all possible actions
+            for(Index a=0; a<nA; ++a) {
+                // Enumerate the possible ending states, kept in increasing order within the row
+                row.clear();
+                successors(external(s), a, row);
+                for(std::pair<Index, Real>& s1_p : row) {
+                    s1_p.first = internal(s1_p.first);
+                }
+                std::sort(row.begin(), row.end());
+                for(std::pair<Index, Real> const& s1_p : row) {
+                    states.push_back(s1_p.first);
+                    probabilities.push_back(s1_p.second);
+                    if(few_here) {
+                        seen.insert(s1_p.second);
+                        few_here = (seen.size() <= Transitions::MAX_DISTINCT);
+                    }
+                }
+                transitions.offsets[s*nA + a + 1] = row.size();
+            }
+        }
+        // Once all row lengths are known, turn them into row positions and allocate the shared arrays
+        #pragma omp barrier
+        #pragma omp single
+        {
+            for(Index row=0; row<nS*nA; ++row) {
+                transitions.offsets[row+1] += transitions.offsets[row];
+            }
+            transitions.states.resize(transitions.offsets.back());
+            transitions.probabilities.resize(transitions.offsets.back());
+        }
+        // Stitch this thread's rows into place, which no other thread writes to
+        std::copy(states.begin(), states.end(), transitions.states.begin() + transitions.offsets[first*nA]);
+        std::copy(probabilities.begin(), probabilities.end(), transitions.probabilities.begin() + transitions.offsets[first*nA]);
+        // Merge in this block's distinct probabilities while there are still few enough
+        #pragma omp critical
+        {
+            few = few and few_here;
+            if(few) {
+                distinct.insert(seen.begin(), seen.end());
+                few = (distinct.size() <= Transitions::MAX_DISTINCT);
+            }
+        }
+    }
+    // Shrink the probabilities to codes if they take few distinct values
+    if(few and transitions.compress(Vector<Real>(distinct.begin(), distinct.end()))) {
+        std::cout << "(Bellman: coded probabilities with a dictionary of " << transitions.dictionary.size()
+                  << " values)" << std::endl;
+    }
+    std::cout << "(Bellman: stored " << transitions.nonzeros() << " nonzero transitions at "
+              << Real(transitions.bytes())/transitions.nonzeros() << " bytes each)" << std::endl;
+}
+
+//////////////////////////////////////////////////
+
+void Bellman::factorize(Vector<uint> const& sizes) {
+    // Assert that the factors exactly cover the state space
+    Index product = 1;
+    for(uint size : sizes) {
+        product *= size;
+    }
+    if(sizes.empty() or (product != nS)) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "State factors have " << product << " combinations for " << nS << " states." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    factors = sizes;
+    std::cout << "(Bellman: factored states into " << factors.size() << " independent factors)" << std::endl;
+}
+
+//////////////////////////////////////////////////
+
+constexpr uint32_t Bellman::MODEL_VERSION;
+constexpr uint32_t Bellman::STATE_VERSION;
+constexpr uint32_t Bellman::SOLUTION_VERSION;
+
+/////////////////////////
+
+uint64_t Bellman::fingerprint(Vector<Real> const& parameters) const {
+    // FNV-1a over the bytes of the shape, discount and parameters
+    uint64_t key = 14695981039346656037ull;
+    auto const mix = [&key](void const* data, size_t bytes) {
+        for(size_t i=0; i<bytes; ++i) {
+            key = (key ^ static_cast<unsigned char const*>(data)[i]) * 1099511628211ull;
+        }
+    };
+    mix(&nS, sizeof(nS));
+    mix(&nA, sizeof(nA));
+    mix(&discount, sizeof(discount));
+    mix(parameters.data(), parameters.size()*sizeof(Real));
+    // Sample the rules at states spread over the state space, so that most edits to them change the key
+    Vector<std::pair<Index, Real>> out;
+    for(Index s=0; s<nS; s+=std::max(nS/64, 1u)) {
+        for(Index a=0; a<nA; ++a) {
+            Real const r = reward(s, a);
+            mix(&r, sizeof(r));
+            out.clear();
+            successors(s, a, out);
+            for(std::pair<Index, Real> const& s1_p : out) {
+                mix(&s1_p.first, sizeof(s1_p.first));
+                mix(&s1_p.second, sizeof(s1_p.second));
+            }
+        }
+    }
+    return key;
+}
+
+/////////////////////////
+
+template <class T>
+void Bellman::write_array(std::ofstream& stream, Vector<T> const& array) {
+    uint64_t const size = array.size();
+    stream.write(reinterpret_cast<char const*>(&size), sizeof(size));
+    stream.write(reinterpret_cast<char const*>(array.data()), size*sizeof(T));
+}
+
+/////////////////////////
+
+template <class T>
+bool Bellman::read_array(std::ifstream& stream, size_t file_size, Vector<T>& array) {
+    uint64_t size = 0;
+    stream.read(reinterpret_cast<char*>(&size), sizeof(size));
+    if(not stream or (size > (file_size - size_t(stream.tellg()))/sizeof(T))) return false;
+    array.resize(size);
+    stream.read(reinterpret_cast<char*>(array.data()), size*sizeof(T));
+    return bool(stream);
+}
+
+/////////////////////////
+
+void Bellman::write_header(std::ofstream& stream, uint64_t key) const {
+    // Header identifying the format, the sizes of the stored types, the model and its shape
+    uint32_t const header[] = {MODEL_VERSION, sizeof(Index), sizeof(Real), nS, nA};
+    stream.write("BELLMAN", 8);
+    stream.write(reinterpret_cast<char const*>(header), sizeof(header));
+    stream.write(reinterpret_cast<char const*>(&key), sizeof(key));
+    stream.write(reinterpret_cast<char const*>(&discount), sizeof(discount));
+}
+
+/////////////////////////
+
+bool Bellman::save_model(std::string const& file, uint64_t key) const {
+    // Write through a temporary file, so that a failed write leaves any earlier model in place
+    std::string const temporary = file + ".tmp";
+    std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+    write_header(stream, key);
+    // Every array, even if empty, in a fixed order
+    write_array(stream, transitions.offsets);
+    write_array(stream, transitions.states);
+    write_array(stream, transitions.bases);
+    write_array(stream, transitions.deltas);
+    write_array(stream, transitions.probabilities);
+    write_array(stream, transitions.dictionary);
+    write_array(stream, transitions.codes8);
+    write_array(stream, transitions.codes16);
+    write_array(stream, rewards);
+    write_array(stream, permutation);
+    write_array(stream, original);
+    size_t const bytes = stream.tellp();
+    stream.close();
+    if(not stream or (std::rename(temporary.c_str(), file.c_str()) != 0)) {
+        std::remove(temporary.c_str());
+        std::cout << "(Bellman: could not save model to " << file << ")" << std::endl;
+        return false;
+    }
+    std::cout << "(Bellman: saved model to " << file << ", " << bytes << " bytes)" << std::endl;
+    return true;
+}
+
+/////////////////////////
+
+bool Bellman::save_model_streamed(std::string const& file, uint64_t key) const {
+    if(not permutation.empty()) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Streaming a model to a file needs the model's own numbering of the states." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    std::cout << "(Bellman: streaming model to " << file << ")" << std::endl;
+    // First pass records the length of each row one past its start, and tabulates the rewards if needed
+    Vector<Index> offsets(size_t(nS)*nA + 1, 0);
+    Vector<Real> table(rewards.empty() ? size_t(nS)*nA : 0);
+    #pragma omp parallel
+    {
+        Vector<std::pair<Index, Real>> row;
+        #pragma omp for schedule(dynamic, 64)
+        for(Index s=0; s<nS; ++s) {
+            for(Index a=0; a<nA; ++a) {
+                row.clear();
+                successors(s, a, row);
+                offsets[s*nA + a + 1] = row.size();
+                if(not table.empty()) table[s*nA + a] = reward(s, a);
+            }
+        }
+    }
+    size_t nonzeros = 0;
+    for(size_t row=1; row<offsets.size(); ++row) {
+        nonzeros += offsets[row];
+        if(nonzeros > std::numeric_limits<Index>::max()) {
+            std::cerr << "================" << std::endl;
+            std::cerr << "The model has more nonzero transitions than a saved model can address." << std::endl;
+            std::cerr << "================" << std::endl;
+            throw -1;
+        }
+        offsets[row] = nonzeros;
+    }
+    // Lay out the whole file, leaving room for the ending states and probabilities
+    std::string const temporary = file + ".tmp";
+    std::ofstream stream(temporary, std::ios::binary | std::ios::trunc);
+    uint64_t const size = nonzeros;
+    uint64_t const none = 0;
+    write_header(stream, key);
+    write_array(stream, offsets);
+    stream.write(reinterpret_cast<char const*>(&size), sizeof(size));
+    std::streamoff const states_at = stream.tellp();
+    stream.seekp(states_at + std::streamoff(nonzeros*sizeof(Index)));
+    stream.write(reinterpret_cast<char const*>(&none), sizeof(none)); // bases
+    stream.write(reinterpret_cast<char const*>(&none), sizeof(none)); // deltas
+    stream.write(reinterpret_cast<char const*>(&size), sizeof(size));
+    std::streamoff const probabilities_at = stream.tellp();
+    stream.seekp(probabilities_at + std::streamoff(nonzeros*sizeof(Real)));
+    stream.write(reinterpret_cast<char const*>(&none), sizeof(none)); // dictionary
+    stream.write(reinterpret_cast<char const*>(&none), sizeof(none)); // codes8
+    stream.write(reinterpret_cast<char const*>(&none), sizeof(none)); // codes16
+    write_array(stream, table.empty() ? rewards : table);
+    write_array(stream, permutation);
+    write_array(stream, original);
+    // Second pass fills in the rows a run of states at a time, checking that they come out the same length
+    Vector<Index> const runs = split_states(offsets, size_t(1) << 22);
+    Vector<Index> states;
+    Vector<Real> probabilities;
+    bool differs = false;
+    for(Index r=0; stream and not differs and (r+1<runs.size()); ++r) {
+        Index const first = offsets[runs[r]*nA];
+        Index const count = offsets[runs[r+1]*nA] - first;
+        states.resize(count);
+        probabilities.resize(count);
+        #pragma omp parallel reduction(||:differs)
+        {
+            Vector<std::pair<Index, Real>> row;
+            #pragma omp for schedule(dynamic, 64)
+            for(Index s=runs[r]; s<runs[r+1]; ++s) {
+                for(Index a=0; a<nA; ++a) {
+                    // Enumerate the possible ending states, kept in increasing order within the row
+                    row.clear();
+                    successors(s, a, row);
+                    std::sort(row.begin(), row.end());
+                    Index k = offsets[s*nA + a] - first;
+                    differs = differs or (row.size() != offsets[s*nA + a + 1] - offsets[s*nA + a]);
+                    for(uint i=0; (i < row.size()) and (k < offsets[s*nA + a + 1] - first); ++i, ++k) {
+                        states[k] = row[i].first;
+                        probabilities[k] = row[i].second;
+                    }
+                }
+            }
+        }
+        stream.seekp(states_at + std::streamoff(size_t(first)*sizeof(Index)));
+        stream.write(reinterpret_cast<char const*>(states.data()), count*sizeof(Index));
+        stream.seekp(probabilities_at + std::streamoff(size_t(first)*sizeof(Real)));
+        stream.write(reinterpret_cast<char const*>(probabilities.data()), count*sizeof(Real));
+    }
+    if(differs) {
+        // Leave no partial file behind
+        stream.close();
+        std::remove(temporary.c_str());
+        std::cerr << "================" << std::endl;
+        std::cerr << "The successors of some state-action pair changed between the two passes." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    stream.close();
+    if(not stream or (std::rename(temporary.c_str(), file.c_str()) != 0)) {
+        std::remove(temporary.c_str());
+        std::cout << "(Bellman: could not save model to " << file << ")" << std::endl;
+        return false;
+    }
+    std::cout << "(Bellman: saved model to " << file << ", " << nonzeros << " nonzero transitions)" << std::endl;
+    return true;
+}
+
+/////////////////////////
+
+Vector<Index> Bellman::split_states(Vector<Index> const& offsets, size_t nonzeros) const {
+    Vector<Index> starts = {0};
+    for(Index s=1; s<nS; ++s) {
+        if(size_t(offsets[(s+1)*nA] - offsets[starts.back()*nA]) > nonzeros) {
+            starts.push_back(s);
+        }
+    }
+    starts.push_back(nS);
+    return starts;
+}
+
+/////////////////////////
+
+template <class T>
+bool Bellman::skip_array(std::ifstream& stream, size_t file_size, Section& section) {
+    section.size = 0;
+    stream.read(reinterpret_cast<char*>(&section.size), sizeof(section.size));
+    section.position = stream.tellg();
+    if(not stream or (section.size > (file_size - size_t(section.position))/sizeof(T))) return false;
+    stream.seekg(section.size*sizeof(T), std::ios::cur);
+    return bool(stream);
+}
+
+/////////////////////////
+
+template <class T>
+bool Bellman::read_slice(std::ifstream& stream, Section const& section, size_t first, size_t count, Vector<T>& out) {
+    if(section.size == 0) {
+        out.clear();
+        return true;
+    }
+    out.resize(count);
+    stream.seekg(section.position + std::streamoff(first*sizeof(T)));
+    stream.read(reinterpret_cast<char*>(out.data()), count*sizeof(T));
+    return bool(stream);
+}
+
+/////////////////////////
+
+bool Bellman::open_model(std::ifstream& stream, std::string const& file, uint64_t key, size_t& file_size) const {
+    stream.open(file, std::ios::binary | std::ios::ate);
+    if(not stream) return false;
+    file_size = stream.tellg();
+    stream.seekg(0);
+    // Accept only a file written in this format for this model
+    char magic[8] = {};
+    uint32_t header[5] = {};
+    uint64_t file_key = 0;
+    Real file_discount = 0.0;
+    stream.read(magic, sizeof(magic));
+    stream.read(reinterpret_cast<char*>(header), sizeof(header));
+    stream.read(reinterpret_cast<char*>(&file_key), sizeof(file_key));
+    stream.read(reinterpret_cast<char*>(&file_discount), sizeof(file_discount));
+    uint32_t const expected[] = {MODEL_VERSION, sizeof(Index), sizeof(Real), nS, nA};
+    if(not stream or (std::memcmp(magic, "BELLMAN", 8) != 0) or (std::memcmp(header, expected, sizeof(header)) != 0)
+       or (file_key != key) or (file_discount != discount)) {
+        std::cout << "(Bellman: " << file << " does not match this model)" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/////////////////////////
+
+bool Bellman::fits_model(Vector<Index> const& offsets, Vector<Index> const& bases, size_t states, size_t deltas,
+                         size_t probabilities, size_t dictionary, size_t codes8, size_t codes16, size_t rewards,
+                         Vector<Index> const& permutation, Vector<Index> const& original) const {
+    size_t const rows = size_t(nS)*nA;
+    bool fits = true;
+    if(offsets.empty()) {
+        // No transitions at all
+        fits = fits and bases.empty() and (states + deltas + probabilities + dictionary + codes8 + codes16 == 0);
+    } else {
+        // Rows ascending from the first nonzero to the last
+        size_t const nonzeros = offsets.back();
+        fits = fits and (offsets.size() == rows + 1) and (offsets[0] == 0) and std::is_sorted(offsets.begin(), offsets.end());
+        // Ending states either plain or delta-encoded from a base per row
+        fits = fits and (((states == nonzeros) and (deltas == 0) and bases.empty())
+                      or ((states == 0) and (deltas == nonzeros) and (bases.size() == rows)));
+        // Probabilities either plain or coded into a dictionary small enough for the codes
+        fits = fits and (((probabilities == nonzeros) and (dictionary + codes8 + codes16 == 0))
+                      or ((probabilities == 0) and (codes8 == nonzeros) and (codes16 == 0) and (dictionary > 0) and (dictionary <= 256))
+                      or ((probabilities == 0) and (codes16 == nonzeros) and (codes8 == 0) and (dictionary > 0) and (dictionary <= 65536)));
+    }
+    fits = fits and ((rewards == 0) or (rewards == rows));
+    // Numbering either the model's own or a permutation with its inverse
+    fits = fits and (permutation.size() == original.size()) and (permutation.empty() or (permutation.size() == nS));
+    for(Index s=0; fits and (s<permutation.size()); ++s) {
+        fits = (permutation[s] < nS) and (original[permutation[s]] == s);
+    }
+    return fits;
+}
+
+/////////////////////////
+
+bool Bellman::fits_states(Transitions const& t) const {
+    if(t.encoded()) {
+        // Accumulate the deltas of each row, which stay below nS if the base and every partial sum does
+        for(Index row=0; row+1<t.offsets.size(); ++row) {
+            Index s1 = t.bases[row];
+            if((t.offsets[row] < t.offsets[row+1]) and (s1 >= nS)) return false;
+            for(Index k=t.offsets[row]; k<t.offsets[row+1]; ++k) {
+                s1 += t.deltas[k];
+                if(s1 >= nS) return false;
+            }
+        }
+    }
+    Index const size = t.dictionary.size();
+    return std::all_of(t.states.begin(), t.states.end(), [this](Index s1) {return s1 < nS;})
+       and std::all_of(t.codes8.begin(), t.codes8.end(), [size](uint8_t c) {return c < size;})
+       and std::all_of(t.codes16.begin(), t.codes16.end(), [size](uint16_t c) {return c < size;});
+}
+
+/////////////////////////
+
+void Bellman::renumber(Vector<Index> const& to_permutation, Vector<Index> const& to_original) {
+    if(to_permutation == permutation) return;
+    Vector<Real> new_value(nS);
+    Vector<Index> new_policy(nS);
+    Vector<uint64_t> new_active(active.size());
+    Vector<Real> new_rewards(rewards.size());
+    for(Index k=0; k<nS; ++k) {
+        // Position of the same state in the current numbering
+        Index const from = internal(to_original.empty() ? k : to_original[k]);
+        new_value[k] = value[from];
+        new_policy[k] = policy[from];
+        if(not active.empty()) new_active[k] = active[from];
+        if(not rewards.empty()) {
+            std::copy(rewards.begin() + size_t(from)*nA, rewards.begin() + size_t(from+1)*nA, new_rewards.begin() + size_t(k)*nA);
+        }
+    }
+    value.swap(new_value);
+    policy.swap(new_policy);
+    active.swap(new_active);
+    rewards.swap(new_rewards);
+    permutation = to_permutation;
+    original = to_original;
+}
+
+/////////////////////////
+
+bool Bellman::load_model(std::string const& file, uint64_t key) {
+    std::ifstream stream;
+    size_t file_size = 0;
+    if(not open_model(stream, file, key, file_size)) return false;
+    // Read into fresh arrays, so that a truncated file leaves the model as it was
+    Transitions loaded;
+    Vector<Real> loaded_rewards;
+    Vector<Index> loaded_permutation, loaded_original;
+    bool const complete = read_array(stream, file_size, loaded.offsets)
+                      and read_array(stream, file_size, loaded.states)
+                      and read_array(stream, file_size, loaded.bases)
+                      and read_array(stream, file_size, loaded.deltas)
+                      and read_array(stream, file_size, loaded.probabilities)
+                      and read_array(stream, file_size, loaded.dictionary)
+                      and read_array(stream, file_size, loaded.codes8)
+                      and read_array(stream, file_size, loaded.codes16)
+                      and read_array(stream, file_size, loaded_rewards)
+                      and read_array(stream, file_size, loaded_permutation)
+                      and read_array(stream, file_size, loaded_original);
+    bool const consistent = complete
+                        and fits_model(loaded.offsets, loaded.bases, loaded.states.size(), loaded.deltas.size(),
+                                       loaded.probabilities.size(), loaded.dictionary.size(), loaded.codes8.size(),
+                                       loaded.codes16.size(), loaded_rewards.size(), loaded_permutation, loaded_original)
+                        and fits_states(loaded);
+    if(not consistent) {
+        std::cout << "(Bellman: " << file << " is incomplete or inconsistent)" << std::endl;
+        return false;
+    }
+    // Carry everything else over to the file's numbering of the states before taking its arrays
+    renumber(loaded_permutation, loaded_original);
+    loaded.dictionary_single.assign(loaded.dictionary.begin(), loaded.dictionary.end());
+    transitions = std::move(loaded);
+    if(not loaded_rewards.empty()) rewards.swap(loaded_rewards);
+    std::cout << "(Bellman: loaded model from " << file << ", " << transitions.nonzeros()
+              << " nonzero transitions)" << std::endl;
+    return true;
+}
+
+//////////////////////////////////////////////////
+
+void Bellman::compress_states() {
+    if(transitions.empty()) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Delta-encoding states needs the transitions from analyze_sparsity." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    size_t const bytes = transitions.bytes();
+    if(transitions.encode()) {
+        std::cout << "(Bellman: delta-encoded ending states, " << Real(bytes)/transitions.nonzeros() << " -> "
+                  << Real(transitions.bytes())/transitions.nonzeros() << " bytes per nonzero)" << std::endl;
+    } else {
+        std::cout << "(Bellman: ending states too far apart to delta-encode)" << std::endl;
+    }
+}
+
+//////////////////////////////////////////////////
+
+void Bellman::analyze_rewards() {
+    std::cout << "(Bellman: tabulating rewards)" << std::endl;
+    rewards.resize(nS*nA);
+    // Iterate over all possible starting states in parallel
+    #pragma omp parallel for schedule(static)
+    for(Index s=0; s<nS; ++s) {
+        // Iterate over all possible actions
+        for(Index a=0; a<nA; ++a) {
+            rewards[s*nA + a] = reward(external(s), a);
+        }
+    }
+}
+
+//////////////////////////////////////////////////
+
+void Bellman::reorder_states() {
+    if(transitions.empty()) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Reordering states needs the transitions from analyze_sparsity." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    std::cout << "(Bellman: reordering states)" << std::endl;
+    // Work with plain ending states
+    bool const encoded = transitions.encoded();
+    transitions.decode();
+    // Largest and mean distance between a state and its successors in the internal numbering
+    auto const bandwidth = [this](Real& mean) {
+        Index width = 0;
+        mean = 0.0;
+        for(Index s=0; s<nS; ++s) {
+            for(Index k=transitions.offsets[s*nA]; k<transitions.offsets[(s+1)*nA]; ++k) {
+                Index const s1 = transitions.states[k];
+                width = std::max(width, (s1 > s) ? s1 - s : s - s1);
+                mean += (s1 > s) ? s1 - s : s - s1;
+            }
+        }
+        mean /= transitions.nonzeros();
+        return width;
+    };
+    Real mean_before, mean_after;
+    Index const before = bandwidth(mean_before);
+    // Build the undirected graph of the transitions, listing each neighbor of each state once
+    Vector<Index> offsets(nS + 1, 0);
+    for(Index s=0; s<nS; ++s) {
+        for(Index k=transitions.offsets[s*nA]; k<transitions.offsets[(s+1)*nA]; ++k) {
+            offsets[s + 1]++;
+            offsets[transitions.states[k] + 1]++;
+        }
+    }
+    for(Index s=0; s<nS; ++s) {
+        offsets[s+1] += offsets[s];
+    }
+    Vector<Index> neighbors(offsets.back());
+    Vector<Index> fill(offsets.begin(), offsets.end() - 1);
+    for(Index s=0; s<nS; ++s) {
+        for(Index k=transitions.offsets[s*nA]; k<transitions.offsets[(s+1)*nA]; ++k) {
+            neighbors[fill[s]++] = transitions.states[k];
+            neighbors[fill[transitions.states[k]]++] = s;
+        }
+    }
+    Vector<Index> degree(nS);
+    for(Index s=0; s<nS; ++s) {
+        std::sort(neighbors.begin() + offsets[s], neighbors.begin() + offsets[s+1]);
+        fill[s] = std::unique(neighbors.begin() + offsets[s], neighbors.begin() + offsets[s+1]) - neighbors.begin();
+        degree[s] = fill[s] - offsets[s];
+    }
+    // Breadth-first search from root over states not yet ordered, returning the depth reached and
+    // storing in farthest the least-connected state at that depth
+    // (a state is seen by the current search once stamped with its generation, so that searching a
+    // part costs only the size of that part)
+    Vector<Index> depth(nS);
+    Vector<bool> visited(nS, false);
+    Vector<Index> queue;
+    Vector<Index> stamp(nS, 0);
+    Index generation = 0;
+    auto const search = [&](Index root, Index& farthest) {
+        queue.assign(1, root);
+        generation++;
+        stamp[root] = generation;
+        depth[root] = 0;
+        for(Index head=0; head<queue.size(); ++head) {
+            Index const s = queue[head];
+            for(Index k=offsets[s]; k<fill[s]; ++k) {
+                if(not visited[neighbors[k]] and (stamp[neighbors[k]] != generation)) {
+                    stamp[neighbors[k]] = generation;
+                    depth[neighbors[k]] = depth[s] + 1;
+                    queue.push_back(neighbors[k]);
+                }
+            }
+        }
+        Index const deepest = depth[queue.back()];
+        farthest = queue.back();
+        for(Index s : queue) {
+            if((depth[s] == deepest) and (degree[s] < degree[farthest])) farthest = s;
+        }
+        return deepest;
+    };
+    // Cuthill-McKee: breadth-first from a pseudo-peripheral state of each connected part, visiting
+    // neighbors in order of increasing degree
+    Vector<Index> by_degree(nS);
+    for(Index s=0; s<nS; ++s) {
+        by_degree[s] = s;
+    }
+    std::stable_sort(by_degree.begin(), by_degree.end(),
+                     [&degree](Index s0, Index s1) {return degree[s0] < degree[s1];});
+    Vector<Index> order;
+    order.reserve(nS);
+    for(Index root : by_degree) {
+        if(visited[root]) continue;
+        // Walk to the far end of the part until its eccentricity stops growing (George-Liu)
+        Index farthest;
+        Index eccentricity = search(root, farthest);
+        while(farthest != root) {
+            Index next;
+            Index const further = search(farthest, next);
+            if(further <= eccentricity) break;
+            root = farthest;
+            farthest = next;
+            eccentricity = further;
+        }
+        visited[root] = true;
+        order.push_back(root);
+        for(Index head=order.size()-1; head<order.size(); ++head) {
+            Index const s = order[head];
+            Index const first = order.size();
+            for(Index k=offsets[s]; k<fill[s]; ++k) {
+                if(not visited[neighbors[k]]) {
+                    visited[neighbors[k]] = true;
+                    order.push_back(neighbors[k]);
+                }
+            }
+            std::stable_sort(order.begin() + first, order.end(),
+                             [&degree](Index s0, Index s1) {return degree[s0] < degree[s1];});
+        }
+    }
+    // Reversing the order tends to reduce the fill of the banded structure further
+    std::reverse(order.begin(), order.end());
+    Vector<Index> position(nS);
+    for(Index k=0; k<nS; ++k) {
+        position[order[k]] = k;
+    }
+    // Move every per-state array and transition row to its new position, relabeling ending states
+    Vector<Real> const old_value = value;
+    Vector<Index> const old_policy = policy;
+    Vector<Real> const old_rewards = rewards;
+    Vector<uint64_t> const old_active = active;
+    Transitions const old = transitions;
+    transitions.offsets[0] = 0;
+    transitions.single.clear();
+    Index k1 = 0;
+    Vector<std::pair<Index, Index>> row;
+    for(Index k=0; k<nS; ++k) {
+        Index const s = order[k];
+        value[k] = old_value[s];
+        policy[k] = old_policy[s];
+        if(not active.empty()) active[k] = old_active[s];
+        for(Index a=0; a<nA; ++a) {
+            if(not rewards.empty()) rewards[k*nA + a] = old_rewards[s*nA + a];
+            // Keep each row in increasing order of ending state, pairing each with its old position
+            row.clear();
+            for(Index k0=old.offsets[s*nA + a]; k0<old.offsets[s*nA + a + 1]; ++k0) {
+                row.emplace_back(position[old.states[k0]], k0);
+            }
+            std::sort(row.begin(), row.end());
+            for(std::pair<Index, Index> const& s1_k0 : row) {
+                transitions.states[k1] = s1_k0.first;
+                if(not old.probabilities.empty()) transitions.probabilities[k1] = old.probabilities[s1_k0.second];
+                if(not old.codes8.empty()) transitions.codes8[k1] = old.codes8[s1_k0.second];
+                if(not old.codes16.empty()) transitions.codes16[k1] = old.codes16[s1_k0.second];
+                ++k1;
+            }
+            transitions.offsets[k*nA + a + 1] = k1;
+        }
+    }
+    // Compose with any earlier reordering to keep the map to the model's own numbering
+    Vector<Index> composed(nS);
+    for(Index k=0; k<nS; ++k) {
+        composed[k] = external(order[k]);
+    }
+    original.swap(composed);
+    permutation.resize(nS);
+    for(Index k=0; k<nS; ++k) {
+        permutation[original[k]] = k;
+    }
+    Index const after = bandwidth(mean_after);
+    if(encoded) transitions.encode();
+    std::cout << "(Bellman: bandwidth " << before << " -> " << after << ", mean successor distance "
+              << mean_before << " -> " << mean_after << ")" << std::endl;
+}
+
+//////////////////////////////////////////////////
+
+template <class Derived>
+Real BellmanT<Derived>::backup(Index s, Vector<Real> const& v, Index& best_action) const {
+    // Qualified calls on the derived class are never dispatched virtually
+    Derived const& model = static_cast<Derived const&>(*this);
+    return backup_with(s, v, best_action,
+                       [&model](Index s, Index a) {return model.Derived::reward(s, a);},
+                       [&model](Index s, Index a, Index s1) {return model.Derived::dynamic(s, a, s1);},
+                       [&model](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+                           model.Derived::factor_successors(s, a, f, out);
+                       });
+}
+
+/////////////////////////
+
+template <class Derived>
+float BellmanT<Derived>::backup(Index s, Vector<float> const& v, Index& best_action) const {
+    Derived const& model = static_cast<Derived const&>(*this);
+    return backup_with(s, v, best_action,
+                       [&model](Index s, Index a) {return model.Derived::reward(s, a);},
+                       [&model](Index s, Index a, Index s1) {return model.Derived::dynamic(s, a, s1);},
+                       [&model](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+                           model.Derived::factor_successors(s, a, f, out);
+                       });
+}
+
+/////////////////////////
+
+template <class Derived>
+Real BellmanT<Derived>::evaluate(Index s, Index a, Vector<Real> const& v) const {
+    Derived const& model = static_cast<Derived const&>(*this);
+    return evaluate_with(s, a, v,
+                         [&model](Index s, Index a) {return model.Derived::reward(s, a);},
+                         [&model](Index s, Index a, Index s1) {return model.Derived::dynamic(s, a, s1);},
+                         [&model](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+                             model.Derived::factor_successors(s, a, f, out);
+                         });
+}
+
+/////////////////////////
+
+template <class Derived>
+Real BellmanT<Derived>::eliminate(Index s, Vector<Real> const& v, Index& best_action, Real margin) {
+    Derived const& model = static_cast<Derived const&>(*this);
+    return eliminate_with(s, v, best_action, margin,
+                          [&model](Index s, Index a) {return model.Derived::reward(s, a);},
+                          [&model](Index s, Index a, Index s1) {return model.Derived::dynamic(s, a, s1);},
+                          [&model](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+                              model.Derived::factor_successors(s, a, f, out);
+                          });
+}
+
+/////////////////////////
+
+template <class Derived>
+void BellmanT<Derived>::successors(Index s, Index a, Vector<std::pair<Index, Real>>& out) const {
+    Derived const& model = static_cast<Derived const&>(*this);
+    if(not factors.empty()) {
+        expand_with(s, a, out, [&model](Index s, Index a, Index f, Vector<std::pair<Index, Real>>& out) {
+            model.Derived::factor_successors(s, a, f, out);
+        });
+        return;
+    }
+    // Iterate over all possible ending states
+    for(Index s1=0; s1<nS; ++s1) {
+        Real p = model.Derived::dynamic(s, a, s1);
+        if(p > 0.0) {
+            out.emplace_back(s1, p);
+        }
+    }
+}
+
+//////////////////////////////////////////////////
+
+DenseBellman::DenseBellman(Vector<Vector<Vector<Real>>> const& T, Vector<Vector<Real>> const& R, Real discount) :
+    BellmanT(T.empty() ? 0 : T[0].size(), T.size(), discount) {
+    // Assert that the matrices are square and agree in shape
+    bool valid = (R.size() == nA);
+    for(Index a=0; a<nA; ++a) {
+        valid = valid and (T[a].size() == nS) and (R[a].size() == nS);
+        for(Index s=0; valid and (s<nS); ++s) {
+            valid = (T[a][s].size() == nS);
+        }
+    }
+    if(not valid) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Dense model needs " << nA << " square transition matrices and reward vectors of size " << nS << "." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    // Lay out the rows of every action one after another
+    P.reserve(size_t(nA)*nS*nS);
+    this->R.reserve(nA*nS);
+    for(Index a=0; a<nA; ++a) {
+        for(Index s=0; s<nS; ++s) {
+            P.insert(P.end(), T[a][s].begin(), T[a][s].end());
+        }
+        this->R.insert(this->R.end(), R[a].begin(), R[a].end());
+    }
+}
+
+/////////////////////////
+
+Real DenseBellman::backup(Index s, Vector<Real> const& v, Index& best_action) const {
+    if(not transitions.empty() or not permutation.empty() or not factors.empty()) {
+        return BellmanT::backup(s, v, best_action);
+    }
+    Real best_value = -INF;
+    best_action = 0;
+    for(Index a=0; a<nA; ++a) {
+        if(not is_active(s, a)) continue;
+        // Contiguous dot product of this action's row with the values
+        Real const* row = &P[(size_t(a)*nS + s)*nS];
+        Real expectation = 0.0;
+        for(Index s1=0; s1<nS; ++s1) {
+            expectation += row[s1] * v[s1];
+        }
+        Real const candidate = R[a*nS + s] + discount*expectation;
+        if(candidate > best_value) {
+            best_value = candidate;
+            best_action = a;
+        }
+    }
+    return best_value;
+}
+
+/////////////////////////
+
+void DenseBellman::backup_all(Vector<Real> const& v, Vector<Real>& next) {
+    if(not transitions.empty() or not permutation.empty() or not factors.empty() or not active.empty()) {
+        Bellman::backup_all(v, next);
+        return;
+    }
+    // Ending states per block, so that the block of values stays in cache across all rows
+    Index constexpr BLOCK = 2048;
+    Index const rows = nA*nS;
+    Q.assign(rows, 0.0);
+    for(Index begin=0; begin<nS; begin+=BLOCK) {
+        Index const end = std::min(begin + BLOCK, nS);
+        #pragma omp parallel for schedule(static)
+        for(Index row=0; row<rows; ++row) {
+            Real const* p = &P[size_t(row)*nS];
+            Real sum = 0.0;
+            for(Index s1=begin; s1<end; ++s1) {
+                sum += p[s1] * v[s1];
+            }
+            Q[row] += sum;
+        }
+    }
+    // Maximize the action values of each state
+    #pragma omp parallel for schedule(static)
+    for(Index s=0; s<nS; ++s) {
+        Real best_value = -INF;
+        for(Index a=0; a<nA; ++a) {
+            Real const candidate = R[a*nS + s] + discount*Q[a*nS + s];
+            if(candidate > best_value) {
+                best_value = candidate;
+                policy[s] = a;
+            }
+        }
+        next[s] = best_value;
+    }
+}
+
+//////////////////////////////////////////////////
+
+constexpr Index DenseBatch::LANES;
+
+/////////////////////////
+
+DenseBatch::DenseBatch(uint N, uint nS, uint nA) :
+    N(N),
+    nS(nS),
+    nA(nA),
+    nB((N + LANES - 1)/LANES),
+    P(size_t(nB)*nA*nS*nS*LANES, 0.0),
+    R(size_t(nB)*nA*nS*LANES, 0.0),
+    discount(nB*LANES, 0.0),
+    value(size_t(nB)*nS*LANES, 0.0),
+    policy(size_t(nB)*nS*LANES, 0),
+    sweeps(N, 0) {
+    // Every instance starts out well-defined, including the padding of the last block
+    for(Index n=0; n<nB*LANES; ++n) {
+        for(Index a=0; a<nA; ++a) {
+            for(Index s=0; s<nS; ++s) {
+                P[lane(n, size_t(nA)*nS*nS, (a*nS + s)*nS + s)] = 1.0;
+            }
+        }
+    }
+}
+
+/////////////////////////
+
+void DenseBatch::set_model(Index n, Vector<Vector<Vector<Real>>> const& T, Vector<Vector<Real>> const& R, Real discount) {
+    // Assert that the instance exists and that its matrices have the shape of the batch
+    bool valid = (n < N) and (T.size() == nA) and (R.size() == nA);
+    for(Index a=0; valid and (a<nA); ++a) {
+        valid = (T[a].size() == nS) and (R[a].size() == nS);
+        for(Index s=0; valid and (s<nS); ++s) {
+            valid = (T[a][s].size() == nS);
+        }
+    }
+    if(not valid) {
+        std::cerr << "================" << std::endl;
+        std::cerr << "Batch instance " << n << " of " << N << " needs " << nA
+                  << " square transition matrices and reward vectors of size " << nS << "." << std::endl;
+        std::cerr << "================" << std::endl;
+        throw -1;
+    }
+    // Scatter into the instance's lane of its block
+    for(Index a=0; a<nA; ++a) {
+        for(Index s=0; s<nS; ++s) {
+            for(Index s1=0; s1<nS; ++s1) {
+                P[lane(n, size_t(nA)*nS*nS, (a*nS + s)*nS + s1)] = T[a][s][s1];
+            }
+            this->R[lane(n, nA*nS, a*nS + s)] = R[a][s];
+        }
+    }
+    this->discount[n] = discount;
+}
+
+/////////////////////////
+
+uint DenseBatch::improve(uint iterations, Real tolerance) {
+    if(iterations == 0) return 0;
+    auto const start = std::chrono::steady_clock::now();
+    uint converged = 0;
+    // Next instance not yet taken up by any thread
+    Index next = 0;
+    #pragma omp parallel reduction(+:converged)
+    {
+        // Working block of this thread, whose lanes each take up a new instance as soon as theirs is done
+        Vector<Real> p(size_t(nA)*nS*nS*LANES);
+        Vector<Real> r(nA*nS*LANES);
+        Vector<Real> v(nS*LANES);
+        Vector<Index> pi(nS*LANES);
+        Real g[LANES];
+        Index instance[LANES]; // instance in each lane, or N once there are none left
+        uint done[LANES]; // sweeps done so far by the instance in each lane
+        // Returns the instance in lane l to storage and loads the next one, if any is left
+        auto const refill = [&](Index l) {
+            if(instance[l] < N) {
+                for(Index s=0; s<nS; ++s) {
+                    value[lane(instance[l], nS, s)] = v[s*LANES + l];
+                    policy[lane(instance[l], nS, s)] = pi[s*LANES + l];
+                }
+                sweeps[instance[l]] = done[l];
+            }
+            Index n;
+            #pragma omp atomic capture
+            n = next++;
+            instance[l] = std::min(n, Index(N));
+            done[l] = 0;
+            if(n >= N) return false;
+            for(size_t k=0; k<size_t(nA)*nS*nS; ++k) {
+                p[k*LANES + l] = P[lane(n, size_t(nA)*nS*nS, k)];
+            }
+            for(Index k=0; k<nA*nS; ++k) {
+                r[k*LANES + l] = R[lane(n, nA*nS, k)];
+            }
+            for(Index s=0; s<nS; ++s) {
+                v[s*LANES + l] = value[lane(n, nS, s)];
+                pi[s*LANES + l] = policy[lane(n, nS, s)];
+            }
+            g[l] = discount[n];
+            return true;
+        };
+        uint occupied = 0;
+        for(Index l=0; l<LANES; ++l) {
+            instance[l] = N;
+            occupied += refill(l);
+        }
+        while(occupied > 0) {
+            // One in-place sweep of every lane at once
+            Real change[LANES] = {};
+            for(Index s=0; s<nS; ++s) {
+                Real best_value[LANES];
+                Index best_action[LANES];
+                std::fill(best_value, best_value + LANES, -INF);
+                std::fill(best_action, best_action + LANES, 0);
+                for(Index a=0; a<nA; ++a) {
+                    // Expected next value of this action for every lane
+                    Real const* const row = &p[size_t(a*nS + s)*nS*LANES];
+                    Real expectation[LANES] = {};
+                    for(Index s1=0; s1<nS; ++s1) {
+                        for(Index l=0; l<LANES; ++l) {
+                            expectation[l] += row[s1*LANES + l] * v[s1*LANES + l];
+                        }
+                    }
+                    for(Index l=0; l<LANES; ++l) {
+                        Real const candidate = r[(a*nS + s)*LANES + l] + g[l]*expectation[l];
+                        bool const better = candidate > best_value[l];
+                        best_value[l] = better ? candidate : best_value[l];
+                        best_action[l] = better ? a : best_action[l];
+                    }
+                }
+                // Fixed-point iterate on value for this starting state, leaving empty lanes alone
+                for(Index l=0; l<LANES; ++l) {
+                    Real const current = v[s*LANES + l];
+                    bool const active = instance[l] < N;
+                    change[l] = std::max(change[l], std::fabs(best_value[l] - current));
+                    v[s*LANES + l] = active ? best_value[l] : current;
+                    pi[s*LANES + l] = active ? best_action[l] : pi[s*LANES + l];
+                }
+            }
+            // Swap out the instances that converged or ran out of iterations
+            for(Index l=0; l<LANES; ++l) {
+                if(instance[l] == N) continue;
+                ++done[l];
+                bool const finished = change[l] < tolerance;
+                converged += finished;
+                if(finished or (done[l] == iterations)) {
+                    occupied -= not refill(l);
                 }
             }
         }
     }
+    std::chrono::duration<Real, std::milli> const elapsed = std::chrono::steady_clock::now() - start;
+    std::cout << "(Bellman: batch of " << N << " instances, " << converged << " converged in "
+              << elapsed.count() << " ms)" << std::endl;
+    return converged;
 }
 
 //////////////////////////////////////////////////
@@ -9,7 +9,7 @@ using namespace bellman;
 
 ////////////////////////////////////////////////// CORE
 
-class GridBoi : public Bellman {
+class GridBoi : public BellmanT<GridBoi> {
     // Grid dimensions
     uint const nX;
     uint const nY;
@@ -56,9 +56,12 @@ class GridBoi : public Bellman {
     enum Action {WAIT, UP, DOWN, LEFT, RIGHT};
 
 public:
-    GridBoi(uint nX=5, uint nY=5) :
-        //            nS      nA   g
-        Bellman(pow(nX*nY, 3), 5, 0.99),
+    // Stores the transitions as a sparse matrix if sparse is set, or otherwise contracts the factors'
+    // small kernels on the fly, which needs far less memory for large grids. Given a cache file, the
+    // sparse matrix is loaded from it if saved there for this grid and these rules, or saved there
+    GridBoi(uint nX=5, uint nY=5, bool sparse=true, std::string const& cache="") :
+        //             nS      nA   g
+        BellmanT(pow(nX*nY, 3), 5, 0.99),
         nX(nX),
         nY(nY),
         state_space(nS) {
@@ -72,9 +75,17 @@ public:
             state_space[i].goo.x = coords[4];
             state_space[i].goo.y = coords[5];
         }
-        analyze_sparsity();
+        factorize({nX*nY, nX*nY, nX*nY});
+        // Reuse the sparse model from an earlier run if one was cached for this grid and these rules
+        // (bump the revision whenever dynamic, factor_successors or reward change)
+        bool const cached = sparse and not cache.empty();
+        uint64_t const key = cached ? fingerprint({Real(nX), Real(nY), 1.0}) : 0;
+        if(cached and load_model(cache, key)) return;
+        if(sparse) analyze_sparsity();
+        analyze_rewards();
         // Sanity checks
         verify_dynamic();
+        if(cached) save_model(cache, key);
     }
 
     // Returns the probability of transitioning to state s1 given state s and action a
@@ -151,6 +162,47 @@ public:
         return p;
     }
 
+    // Lists the nonzero-probability positions of the boi (f=0), gob (f=1) or goo (f=2) in the ending
+    // state given state s and action a, each of which moves independently of the others
+    void factor_successors(Index s_index, Index a, Index f, Vector<std::pair<Index, Real>>& out) const override {
+        State const s = state_space[s_index];
+        // Appends a position, numbered the same way as index_from_coords({x, y}, {nX, nY})
+        auto const emit = [&out, this](State::Coord const& coord, Real p) {
+            out.emplace_back(coord.x*nY + coord.y, p);
+        };
+        if(f == 0) {
+            // Determine the boi's deterministic move, standing still at the edges of the grid
+            State::Coord boi = s.boi;
+            if((a == Action::UP) and (s.boi.y != nY-1)) boi = s.boi.up();
+            else if((a == Action::DOWN) and (s.boi.y != 0)) boi = s.boi.down();
+            else if((a == Action::LEFT) and (s.boi.x != 0)) boi = s.boi.left();
+            else if((a == Action::RIGHT) and (s.boi.x != nX-1)) boi = s.boi.right();
+            emit(boi, 1.0);
+        }
+        else if(f == 1) {
+            // List the gob's equally likely moves that stay on the grid
+            uint const n_gob_moves = 1 + (s.gob.y != nY-1) + (s.gob.y != 0) + (s.gob.x != 0) + (s.gob.x != nX-1);
+            Real const p = 1.0/n_gob_moves;
+            emit(s.gob, p);
+            if(s.gob.y != nY-1) emit(s.gob.up(), p);
+            if(s.gob.y != 0) emit(s.gob.down(), p);
+            if(s.gob.x != 0) emit(s.gob.left(), p);
+            if(s.gob.x != nX-1) emit(s.gob.right(), p);
+        }
+        else {
+            // List the goo's equally likely positions, anywhere if the boi just got it
+            if(s.boi == s.goo) {
+                Real const p = 1.0/(nX*nY);
+                for(uint x=0; x<nX; ++x) {
+                    for(uint y=0; y<nY; ++y) {
+                        emit({int(x), int(y)}, p);
+                    }
+                }
+            }
+            else emit(s.goo, 1.0);
+        }
+    }
+
     // Returns the (deterministic) reward for selecting action a in state s
     Real reward(Index s_index, Index a) const override {
         State const s = state_space[s_index];
@@ -163,27 +215,17 @@ public:
 
     // Prettier version of this base method for GridBoi specifically
     void record_solution(std::string const& file) const override {
-        // Open and clear file
-        std::ofstream stream;
-        stream.open(file);
-        stream << nX << " " << nY << std::endl;
-        // Write header string as first line
-        stream << "boi_x, boi_y,  gob_x, gob_y,  goo_x, goo_y,  action, value" << std::endl;
-        for(Index s_index=0; s_index<nS; ++s_index) {
+        // Write grid dimensions and header string as first lines
+        std::string const header = std::to_string(nX) + " " + std::to_string(nY) + "\n"
+                                 + "boi_x, boi_y,  gob_x, gob_y,  goo_x, goo_y,  action, value\n";
+        record_lines(file, header, [this](Index s_index, std::string& out) {
             State const s = state_space[s_index];
             // Write comma-delimited state-action-value tuples
-            stream << s.boi.x << ", "
-                   << s.boi.y << ",  "
-                   << s.gob.x << ", "
-                   << s.gob.y << ",  "
-                   << s.goo.x << ", "
-                   << s.goo.y << ",  "
-                   << policy[s_index] << ", "
-                   << value[s_index]
-                   << std::endl;
-        }
-        // Close file
-        stream.close();
+            append(out, s.boi.x, ", ", s.boi.y, ",  ",
+                        s.gob.x, ", ", s.gob.y, ",  ",
+                        s.goo.x, ", ", s.goo.y, ",  ",
+                        get_action_at(s_index), ", ", get_value_at(s_index), "\n");
+        });
     }
 };
 
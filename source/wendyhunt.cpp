@@ -9,35 +9,24 @@ using namespace bellman;
 
 ////////////////////////////////////////////////// CORE
 
-class WendyHunt : public Bellman {
-    Vector<Vector<Vector<Real>>> const T; // transition matrix
-    Vector<Vector<Real>> const R; // reward matrix
-
+class WendyHunt : public DenseBellman {
 public:
     WendyHunt() :
-        //      nS nA   g
-        Bellman(3, 2, 0.99),
-        // Assign transition matrix values
-        T({{{  1,   0,   0},
-            {  1,   0,   0},
-            {  0, 0.3, 0.7}},
-           {{0.4,   0, 0.6},
-            {0.1, 0.6, 0.3},
-            {  0, 0.1, 0.9}}}),
-        // Assign reward matrix values
-        R({{1, 1, 3},
-           {0, 0, 2}}) {
+        // Transition matrix
+        DenseBellman({{{  1,   0,   0},
+                       {  1,   0,   0},
+                       {  0, 0.3, 0.7}},
+                      {{0.4,   0, 0.6},
+                       {0.1, 0.6, 0.3},
+                       {  0, 0.1, 0.9}}},
+                     // Reward matrix
+                     {{1, 1, 3},
+                      {0, 0, 2}},
+                     // Discount
+                     0.99) {
         // Sanity checks
         verify_dynamic();
     }
-
-    Real dynamic(Index s, Index a, Index s1) const override {
-        return T[a][s][s1];
-    }
-
-    Real reward(Index s, Index a) const override {
-        return R[a][s];
-    }
 };
 
 ////////////////////////////////////////////////// MAIN